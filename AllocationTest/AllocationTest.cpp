@@ -0,0 +1,79 @@
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "../ComputerGraphic/TestRunner.h"
+
+using namespace std;
+
+// Test-only executable: the counting replacement of the global operator new
+// must not be linked into ComputerGraphic itself. It counts the allocations
+// of the filter code compiled into this program; planes created inside a
+// shared OpenCV library are counted by the Mat allocator of runAllocationTest.
+
+static atomic<size_t> heapAllocations{ 0 };
+
+void* operator new(size_t size)
+{
+    heapAllocations++;
+    if (void* memory = malloc(size ? size : 1))
+        return memory;
+    throw bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+// GCC pairs the inlined free with the operator new of the caller and warns
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+void operator delete[](void* memory) noexcept
+{
+    operator delete(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    operator delete(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+    operator delete(memory);
+}
+
+// AllocationTest <source image> [calls]
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        cerr << "Usage: AllocationTest <source image> [calls]" << endl;
+        return 2;
+    }
+
+    cv::Mat image = cv::imread(argv[1]);
+    if (image.empty())
+    {
+        cerr << "Cannot load " << argv[1] << endl;
+        return 2;
+    }
+
+    int calls = (argc == 3) ? atoi(argv[2]) : 10;
+    bool passed = TestRunner::runAllocationTest(image, calls, []() { return heapAllocations.load(); });
+
+    cout << "\n" << (passed ? "ALLOCATION TEST PASSED" : "ALLOCATION TEST FAILED") << "\n";
+    return passed ? 0 : 1;
+}
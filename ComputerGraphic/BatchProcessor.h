@@ -0,0 +1,281 @@
+#pragma once
+
+#include <opencv.hpp>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+#include <cctype>
+#include "BoundedQueue.h"
+#include "ShadowHighlightsFilter.h"
+
+/// <summary>
+/// Applies one filter setup to many images in a decode -> filter -> encode pipeline.
+///
+/// Each stage has its own threads and hands images to the next one through a
+/// bounded queue, so decoding and encoding of other images overlap with the
+/// filter and at most a fixed number of images are held in memory.
+/// </summary>
+class BatchProcessor
+{
+public:
+
+    /// <summary>
+    /// Thread counts per stage and queue capacity
+    /// </summary>
+    struct Settings
+    {
+        /// <summary>Threads reading and decoding images</summary>
+        int decodeThreads = 2;
+
+        /// <summary>Threads running the filter, 0 for all hardware threads</summary>
+        int filterThreads = 0;
+
+        /// <summary>Threads encoding and writing images</summary>
+        int encodeThreads = 2;
+
+        /// <summary>Images waiting between two stages</summary>
+        size_t queueCapacity = 4;
+
+        /// <summary>Quality of written JPEG files (0 - 100)</summary>
+        int jpegQuality = 95;
+    };
+
+    /// <summary>
+    /// Result of a batch run
+    /// </summary>
+    struct Report
+    {
+        size_t images = 0;
+        double megapixels = 0.0;
+        double seconds = 0.0;
+
+        /// <summary>Inputs that could not be read, filtered or written</summary>
+        std::vector<std::string> failures;
+
+        double imagesPerSecond() const { return seconds > 0.0 ? images / seconds : 0.0; }
+        double megapixelsPerSecond() const { return seconds > 0.0 ? megapixels / seconds : 0.0; }
+    };
+
+private:
+
+    ShadowHighlightsFilter filter;
+    Settings settings;
+
+    /// <summary>Image travelling through the pipeline</summary>
+    struct Item
+    {
+        std::string inputPath;
+        cv::Mat image;
+    };
+
+public:
+
+    /// <summary>
+    /// Creates a batch processor with the default stage setup
+    /// </summary>
+    /// <param name="filter">Configured filter applied to every image</param>
+    explicit BatchProcessor(const ShadowHighlightsFilter& filter)
+        : BatchProcessor(filter, Settings())
+    {
+    }
+
+    /// <summary>
+    /// Creates a batch processor
+    /// </summary>
+    /// <param name="filter">Configured filter applied to every image</param>
+    /// <param name="settings">Stage threads and queue capacity</param>
+    BatchProcessor(const ShadowHighlightsFilter& filter, Settings settings)
+        : filter(filter),
+          settings(settings)
+    {
+        if (settings.decodeThreads < 1 || settings.encodeThreads < 1 || settings.filterThreads < 0)
+            throw std::invalid_argument("Stage thread counts must be positive");
+    }
+
+    /// <summary>
+    /// Lists the image files of a directory in name order
+    /// </summary>
+    /// <param name="directory">Directory to scan, not recursive</param>
+    /// <returns>Paths of .jpg, .jpeg, .png, .bmp, .tif and .tiff files</returns>
+    static std::vector<std::string> listImages(const std::string& directory)
+    {
+        std::vector<std::string> files;
+
+        for (const auto& entry : std::filesystem::directory_iterator(directory))
+        {
+            if (!entry.is_regular_file())
+                continue;
+
+            std::string extension = entry.path().extension().string();
+            std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+
+            if (extension == ".jpg" || extension == ".jpeg" || extension == ".png" || extension == ".bmp" || extension == ".tif" || extension == ".tiff")
+                files.push_back(entry.path().string());
+        }
+
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+
+    /// <summary>
+    /// Processes every image of a directory
+    /// </summary>
+    /// <param name="inputDirectory">Directory with source images</param>
+    /// <param name="outputDirectory">Directory for results, created if missing</param>
+    /// <returns>Counts, failures and throughput</returns>
+    Report run(const std::string& inputDirectory, const std::string& outputDirectory)
+    {
+        return run(listImages(inputDirectory), outputDirectory);
+    }
+
+    /// <summary>
+    /// Processes a list of images. Each result is written under the input
+    /// file name, so inputs from different directories must not share names.
+    /// </summary>
+    /// <param name="inputFiles">Source image paths</param>
+    /// <param name="outputDirectory">Directory for results, created if missing</param>
+    /// <returns>Counts, failures and throughput</returns>
+    Report run(const std::vector<std::string>& inputFiles, const std::string& outputDirectory)
+    {
+        std::filesystem::create_directories(outputDirectory);
+
+        int filterThreads = settings.filterThreads > 0 ? settings.filterThreads : std::max(1, (int)std::thread::hardware_concurrency());
+
+        BoundedQueue<Item> decoded(settings.queueCapacity), filtered(settings.queueCapacity);
+        std::atomic<size_t> nextInput{ 0 };
+        std::atomic<size_t> images{ 0 };
+        std::atomic<uint64_t> pixels{ 0 };
+
+        std::mutex failuresMutex;
+        std::vector<std::string> failures;
+        auto fail = [&](const std::string& path)
+            {
+                std::lock_guard<std::mutex> lock(failuresMutex);
+                failures.push_back(path);
+            };
+
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> decoders, filters, encoders;
+
+        for (int t = 0; t < settings.decodeThreads; t++)
+            decoders.emplace_back([&]()
+                {
+                    for (size_t i = nextInput++; i < inputFiles.size(); i = nextInput++)
+                    {
+                        Item item{ inputFiles[i], cv::Mat() };
+
+                        try
+                        {
+                            item.image = cv::imread(item.inputPath);
+                        }
+                        catch (const std::exception&)
+                        {
+                        }
+
+                        if (item.image.empty())
+                            fail(item.inputPath);
+                        else
+                            decoded.push(std::move(item));
+                    }
+                });
+
+        for (int t = 0; t < filterThreads; t++)
+            filters.emplace_back([&, filterThreads]()
+                {
+                    // Images already give every thread work; a single filter thread keeps the filter's own row bands
+                    ShadowHighlightsFilter worker = filter;
+                    if (filterThreads > 1)
+                        worker.setThreadCount(1);
+                    worker.setCacheEnabled(false);
+
+                    Item item;
+                    while (decoded.pop(item))
+                    {
+                        try
+                        {
+                            // The decoded image is not needed afterwards, so the result overwrites it
+                            worker.apply(item.image, item.image);
+                            filtered.push(std::move(item));
+                        }
+                        catch (const std::exception&)
+                        {
+                            fail(item.inputPath);
+                        }
+                    }
+                });
+
+        for (int t = 0; t < settings.encodeThreads; t++)
+            encoders.emplace_back([&]()
+                {
+                    std::vector<int> parameters = { cv::IMWRITE_JPEG_QUALITY, settings.jpegQuality };
+
+                    Item item;
+                    while (filtered.pop(item))
+                    {
+                        std::string outputPath = (std::filesystem::path(outputDirectory) / std::filesystem::path(item.inputPath).filename()).string();
+                        bool written = false;
+
+                        try
+                        {
+                            written = cv::imwrite(outputPath, item.image, parameters);
+                        }
+                        catch (const std::exception&)
+                        {
+                        }
+
+                        if (!written)
+                        {
+                            fail(item.inputPath);
+                            continue;
+                        }
+
+                        images++;
+                        pixels += (uint64_t)item.image.total();
+                    }
+                });
+
+        // Each stage ends once its producers are done and its queue is drained
+        for (std::thread& thread : decoders)
+            thread.join();
+        decoded.close();
+
+        for (std::thread& thread : filters)
+            thread.join();
+        filtered.close();
+
+        for (std::thread& thread : encoders)
+            thread.join();
+
+        Report report;
+        report.images = images;
+        report.megapixels = pixels / 1e6;
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        report.failures = std::move(failures);
+        std::sort(report.failures.begin(), report.failures.end());
+        return report;
+    }
+
+    /// <summary>
+    /// Prints counts and throughput of a run
+    /// </summary>
+    /// <param name="report">Result of run</param>
+    static void printReport(const Report& report)
+    {
+        std::cout << "==========================================\nBATCH PROCESSING REPORT\n==========================================\n";
+        std::cout << "Images processed: " << report.images << "\nImages failed: " << report.failures.size() << "\n";
+        std::cout << std::fixed << std::setprecision(2);
+        std::cout << "Total time: " << report.seconds << " s\n";
+        std::cout << "Throughput: " << report.imagesPerSecond() << " images/s, " << report.megapixelsPerSecond() << " MP/s\n";
+
+        for (const std::string& path : report.failures)
+            std::cout << "Failed: " << path << "\n";
+    }
+};
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <opencv.hpp>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <memory>
+#include "ColorConverter.h"
+#include "LabImageProcessor.h"
+#include "GaussianBlur.h"
+#include "ThreadPool.h"
+#include "ShadowHighlightsFilter.h"
+
+/// <summary>
+/// Timing benchmarks for the filter kernels
+/// </summary>
+class BenchmarkRunner
+{
+public:
+
+    /// <summary>
+    /// Compares the exact separable blur against the recursive blur over a radius sweep
+    /// and reports the radius from which the recursive blur is faster
+    /// </summary>
+    /// <param name="width">Plane width</param>
+    /// <param name="height">Plane height</param>
+    static void runBlurCrossover(int width = 1920, int height = 1080)
+    {
+        std::cout << "==========================================\nBLUR CROSSOVER BENCHMARK (" << width << "x" << height << ")\n==========================================\n";
+
+        cv::Mat plane(height, width, CV_32F);
+        cv::randu(plane, 0.0f, 1.0f);
+
+        std::cout << std::setw(8) << "radius" << std::setw(14) << "exact, ms" << std::setw(16) << "recursive, ms" << std::setw(14) << "max error\n";
+
+        int crossover = -1;
+
+        for (int radius : { 1, 2, 3, 4, 6, 8, 10, 12, 16, 20, 25, 33, 50, 75 })
+        {
+            std::vector<float> kernel = GaussianBlur::createKernel(2 * radius + 1, (float)radius);
+            float sigma = std::sqrt(GaussianBlur::kernelVariance(kernel));
+
+            cv::Mat exact, recursive;
+            double exactMs = measureMs([&]() { exact = GaussianBlur::apply(plane, kernel); });
+            double recursiveMs = measureMs([&]() { recursive = GaussianBlur::applyRecursive(plane, sigma); });
+
+            double maxError = cv::norm(exact, recursive, cv::NORM_INF);
+
+            std::cout << std::setw(8) << radius << std::setw(14) << std::fixed << std::setprecision(2) << exactMs << std::setw(16) << recursiveMs << std::setw(13) << std::setprecision(4) << maxError << "\n";
+
+            if (crossover < 0 && recursiveMs < exactMs)
+                crossover = radius;
+        }
+
+        if (crossover > 0)
+            std::cout << "\nRecursive blur is faster from radius " << crossover << " px\n";
+        else
+            std::cout << "\nRecursive blur was not faster in the tested range\n";
+    }
+
+    /// <summary>
+    /// Reports how far the box cascade is from the exact kernel of the same
+    /// variance, per blur and for the whole filter. Blurs are compared on a
+    /// plane of hard-edged blocks, where the shapes differ most, and on noise.
+    /// </summary>
+    /// <param name="width">Plane and image width</param>
+    /// <param name="height">Plane and image height</param>
+    static void runBoxCascadeError(int width = 1920, int height = 1080)
+    {
+        std::cout << "==========================================\nBOX CASCADE ERROR REPORT (" << width << "x" << height << ")\n==========================================\n";
+
+        // Blocks of 64 px with values 0, 0.25 ... 1, and uniform noise
+        cv::Mat blocks(height, width, CV_32F), noise(height, width, CV_32F);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                blocks.at<float>(y, x) = (float)((x / 64 * 7 + y / 64 * 13) % 5) / 4.0f;
+        cv::randu(noise, 0.0f, 1.0f);
+
+        std::cout << std::setw(8) << "radius" << std::setw(8) << "sigma" << std::setw(12) << "boxes" << std::setw(12) << "exact, ms" << std::setw(10) << "box, ms"
+                  << std::setw(14) << "max (edges)" << std::setw(15) << "mean (edges)" << std::setw(14) << "max (noise)" << "\n";
+
+        for (int radius : { 2, 4, 8, 12, 16, 25, 33, 50 })
+        {
+            std::vector<float> kernel = GaussianBlur::createKernel(2 * radius + 1, (float)radius);
+            float sigma = std::sqrt(GaussianBlur::kernelVariance(kernel));
+
+            int radii[3];
+            GaussianBlur::boxRadii(sigma, radii);
+            std::string boxes = std::to_string(2 * radii[0] + 1) + "/" + std::to_string(2 * radii[1] + 1) + "/" + std::to_string(2 * radii[2] + 1);
+
+            cv::Mat exact, box;
+            double exactMs = measureMs([&]() { exact = GaussianBlur::apply(blocks, kernel); });
+            double boxMs = measureMs([&]() { box = GaussianBlur::applyBoxCascade(blocks, sigma); });
+            double maxEdges = cv::norm(exact, box, cv::NORM_INF), meanEdges = cv::norm(exact, box, cv::NORM_L1) / exact.total();
+            double maxNoise = cv::norm(GaussianBlur::apply(noise, kernel), GaussianBlur::applyBoxCascade(noise, sigma), cv::NORM_INF);
+
+            std::cout << std::setw(8) << radius << std::setw(8) << std::fixed << std::setprecision(2) << sigma << std::setw(12) << boxes
+                      << std::setw(12) << exactMs << std::setw(10) << boxMs << std::setprecision(4) << std::setw(14) << maxEdges << std::setw(15) << meanEdges << std::setw(14) << maxNoise << "\n";
+        }
+
+        // The filter on a color version of the blocks: difference of the 8-bit results
+        cv::Mat gray, image;
+        blocks.convertTo(gray, CV_8U, 255.0);
+        cv::cvtColor(gray, image, cv::COLOR_GRAY2BGR);
+
+        std::cout << "\n" << std::setw(12) << "blur radius" << std::setw(20) << "filter max, levels" << std::setw(21) << "filter mean, levels" << "\n";
+
+        for (float blurRadius : { 5.0f, 15.0f, 30.0f, 50.0f })
+        {
+            ShadowHighlightsFilter filter(0.5f, 0.4f, 0.5f, blurRadius);
+            filter.setCacheEnabled(false);
+            cv::Mat exact = filter.apply(image);
+            filter.setBlurMode(ShadowHighlightsFilter::BlurMode::BoxCascade);
+            cv::Mat box = filter.apply(image);
+
+            std::cout << std::setw(12) << std::setprecision(0) << blurRadius << std::setw(20) << cv::norm(exact, box, cv::NORM_INF)
+                      << std::setw(21) << std::setprecision(3) << cv::norm(exact, box, cv::NORM_L1) / exact.total() / 3 << "\n";
+        }
+    }
+
+    /// <summary>
+    /// Compares applySweep with separate apply calls, for combinations that
+    /// share their masks (only the amounts vary) and for combinations that
+    /// each have their own blur radius
+    /// </summary>
+    /// <param name="width">Image width</param>
+    /// <param name="height">Image height</param>
+    /// <param name="threads">Threads of the filter, 0 for all hardware threads</param>
+    static void runSweepBenchmark(int width = 1500, int height = 1000, int threads = 0)
+    {
+        std::cout << "==========================================\nSWEEP BENCHMARK (" << width << "x" << height << ")\n==========================================\n";
+
+        cv::Mat image(height, width, CV_8UC3);
+        cv::randu(image, 0, 256);
+
+        std::vector<ShadowHighlightsFilter::Params> sharedMasks(20), distinctRadii(8);
+        for (size_t i = 0; i < sharedMasks.size(); i++)
+        {
+            sharedMasks[i].shadowAmount = 0.05f * (i % 10);
+            sharedMasks[i].highlightAmount = 0.1f * (i / 10);
+        }
+        for (size_t i = 0; i < distinctRadii.size(); i++)
+            distinctRadii[i].blurRadius = 5.0f + 5.0f * i;
+
+        std::cout << std::left << std::setw(26) << "case" << std::right << std::setw(12) << "sweep, ms" << std::setw(15) << "separate, ms" << std::setw(12) << "identical" << "\n";
+
+        auto compare = [&](const std::string& name, const std::vector<ShadowHighlightsFilter::Params>& combinations)
+            {
+                // Without the stage cache, so every run recomputes luminance
+                ShadowHighlightsFilter filter;
+                filter.setThreadCount(threads);
+                filter.setCacheEnabled(false);
+
+                std::vector<cv::Mat> swept, separate(combinations.size());
+                double sweepMs = measureMs([&]() { swept = filter.applySweep(image, combinations); });
+                double separateMs = measureMs([&]()
+                    {
+                        for (size_t i = 0; i < combinations.size(); i++)
+                        {
+                            const ShadowHighlightsFilter::Params& params = combinations[i];
+                            filter.setShadowAmount(params.shadowAmount);
+                            filter.setHighlightAmount(params.highlightAmount);
+                            filter.setTonalWidth(params.tonalWidth);
+                            filter.setBlurRadius(params.blurRadius);
+                            separate[i] = filter.apply(image);
+                        }
+                    });
+
+                bool identical = true;
+                for (size_t i = 0; i < combinations.size(); i++)
+                    identical = identical && cv::norm(swept[i], separate[i], cv::NORM_INF) == 0.0;
+
+                std::cout << std::left << std::setw(26) << name << std::right << std::fixed << std::setprecision(1) << std::setw(12) << sweepMs
+                          << std::setw(15) << separateMs << std::setw(12) << (identical ? "yes" : "NO") << "\n";
+            };
+
+        compare("20 sharing masks", sharedMasks);
+        compare("8 distinct radii", distinctRadii);
+    }
+
+    /// <summary>
+    /// Times every kernel of the pipeline at several image sizes: the color
+    /// conversions, Lab split and merge, the mask blur over a radius sweep,
+    /// the mask stages of apply (from its StageStats) and the whole apply.
+    /// GB/s counts every input byte read and output byte written once, so
+    /// it shows how close a kernel is to the memory bandwidth.
+    /// </summary>
+    /// <param name="sizes">Image sizes, by default VGA, 12, 24 and 100 MP</param>
+    /// <param name="threads">Threads of every kernel, 0 for all hardware threads</param>
+    static void runKernelSuite(const std::vector<cv::Size>& sizes = { cv::Size(640, 480), cv::Size(4000, 3000), cv::Size(6000, 4000), cv::Size(12000, 8400) }, int threads = 1)
+    {
+        std::unique_ptr<ThreadPool> pool;
+        if (threads != 1)
+            pool.reset(new ThreadPool(threads));
+
+        for (const cv::Size& size : sizes)
+        {
+            const size_t pixels = size.area();
+            const int repeats = pixels > 20000000 ? 1 : 3;
+
+            std::cout << "==========================================\nKERNEL BENCHMARK (" << size.width << "x" << size.height << ", " << std::fixed << std::setprecision(1) << pixels / 1e6 << " MP)\n==========================================\n";
+            std::cout << std::left << std::setw(26) << "kernel" << std::right << std::setw(12) << "ms" << std::setw(12) << "ns/pixel" << std::setw(10) << "GB/s" << "\n";
+
+            auto report = [&](const std::string& name, double ms, double bytesPerPixel)
+                {
+                    std::cout << std::left << std::setw(26) << name << std::right << std::fixed << std::setprecision(2) << std::setw(12) << ms
+                              << std::setw(12) << ms * 1e6 / pixels << std::setw(10) << bytesPerPixel * pixels / (ms * 1e6) << "\n";
+                };
+
+            cv::Mat bgr(size, CV_8UC3);
+            cv::randu(bgr, 0, 256);
+
+            // Color conversions
+            cv::Mat lab(size, CV_32FC3), bgrBack(size, CV_8UC3), luminance(size, CV_32F);
+            report("BGR2Lab", measureMs([&]() { ThreadPool::run(pool.get(), 0, size.height, [&](int b, int e) { ColorConverter::BGR2Lab(bgr, lab, b, e); }); }, repeats), 3 + 12);
+            report("Lab2BGR", measureMs([&]() { ThreadPool::run(pool.get(), 0, size.height, [&](int b, int e) { ColorConverter::Lab2BGR(lab, bgrBack, b, e); }); }, repeats), 12 + 3);
+            report("BGR2Luminance", measureMs([&]() { ThreadPool::run(pool.get(), 0, size.height, [&](int b, int e) { ColorConverter::BGR2Luminance(bgr, luminance, b, e); }); }, repeats), 3 + 4);
+            report("ReplaceLuminance", measureMs([&]() { ThreadPool::run(pool.get(), 0, size.height, [&](int b, int e) { ColorConverter::ReplaceLuminance(bgr, luminance, 1.0f, bgrBack, b, e); }); }, repeats), 3 + 4 + 3);
+
+            // Lab planes
+            std::vector<cv::Mat> channels = { cv::Mat(size, CV_32F), cv::Mat(size, CV_32F), cv::Mat(size, CV_32F) };
+            report("splitLab", measureMs([&]() { ThreadPool::run(pool.get(), 0, size.height, [&](int b, int e) { LabImageProcessor::splitLab(lab, channels, b, e); }); }, repeats), 12 + 12);
+            report("mergeLab", measureMs([&]() { ThreadPool::run(pool.get(), 0, size.height, [&](int b, int e) { LabImageProcessor::mergeLab(channels, lab, b, e); }); }, repeats), 12 + 12);
+            channels.clear();
+
+            // Planar Lab straight from BGR, no interleaved image and no split
+            LabImageProcessor::PlanarLab planar(size);
+            report("BGR2LabPlanes", measureMs([&]() { ThreadPool::run(pool.get(), 0, size.height, [&](int b, int e) { ColorConverter::BGR2LabPlanes(bgr, planar.channels[0], planar.channels[1], planar.channels[2], b, e); }); }, repeats), 3 + 12);
+            planar = LabImageProcessor::PlanarLab();
+            lab.release();
+            bgrBack.release();
+
+            // Blur of one float plane, two passes of one read and one write each
+            cv::Mat plane;
+            luminance.convertTo(plane, CV_32F, 1.0 / 255.0);
+            luminance.release();
+
+            for (int radius : { 2, 5, 10, 20, 50 })
+            {
+                std::vector<float> kernel = GaussianBlur::createKernel(2 * radius + 1, (float)radius);
+                report("blur exact r=" + std::to_string(radius), measureMs([&]() { GaussianBlur::apply(plane, kernel, pool.get()); }, repeats), 16);
+            }
+            for (int radius : { 5, 50 })
+                report("blur recursive r=" + std::to_string(radius), measureMs([&]() { GaussianBlur::applyRecursive(plane, (float)radius, pool.get()); }, repeats), 16);
+
+            // The passes alone: the vertical one walks columns and should stay close to the horizontal one
+            cv::Mat passOutput;
+            for (int radius : { 5, 20, 50 })
+            {
+                std::vector<float> kernel = GaussianBlur::createKernel(2 * radius + 1, (float)radius);
+                report("pass horizontal r=" + std::to_string(radius), measureMs([&]() { GaussianBlur::applyHorizontal(plane, passOutput, kernel, pool.get()); }, repeats), 8);
+                report("pass vertical r=" + std::to_string(radius), measureMs([&]() { GaussianBlur::applyVertical(plane, passOutput, kernel, pool.get()); }, repeats), 8);
+            }
+            passOutput.release();
+            plane.release();
+
+            // Mask stages and the whole filter, without the stage cache so every run recomputes
+            ShadowHighlightsFilter filter;
+            filter.setThreadCount(threads);
+            filter.setCacheEnabled(false);
+
+            StageStats best;
+            double applyMs = measureMs([&]()
+                {
+                    StageStats stats;
+                    filter.apply(bgr, stats);
+                    if (best.stages.empty() || stats.totalMilliseconds() < best.totalMilliseconds())
+                        best = stats;
+                }, repeats);
+
+            for (const char* stage : { "classify masks", "mask blur", "upsample masks", "mask maxima", "correction" })
+            {
+                double ms = 0.0, planePixels = 0.0;
+                for (const StageRecord& record : best.stages)
+                    if (record.name == stage)
+                    {
+                        ms += record.milliseconds;
+                        planePixels += (double)record.pixels;
+                    }
+
+                if (ms > 0.0)
+                    report(std::string("apply: ") + stage, ms, 2 * sizeof(float) * planePixels / pixels);
+            }
+            report("apply (whole)", applyMs, 3 + 3);
+            std::cout << "\n";
+        }
+    }
+
+private:
+
+    /// <summary>
+    /// Measures the best wall time of several runs
+    /// </summary>
+    /// <param name="function">Code to measure</param>
+    /// <param name="repeats">Number of runs</param>
+    /// <returns>Minimum time in milliseconds</returns>
+    template <typename Function>
+    static double measureMs(Function function, int repeats = 3)
+    {
+        double best = 0.0;
+
+        for (int i = 0; i < repeats; i++)
+        {
+            int64 start = cv::getTickCount();
+            function();
+            double ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+
+            if (i == 0 || ms < best)
+                best = ms;
+        }
+
+        return best;
+    }
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+/// <summary>
+/// Blocking queue with a fixed capacity for handing items between pipeline stages.
+///
+/// push waits while the queue is full, so a fast stage cannot run ahead of a
+/// slow one by more than the capacity. After close, pop drains the remaining
+/// items and then returns false.
+/// </summary>
+template <typename T>
+class BoundedQueue
+{
+    std::mutex stateMutex;
+    std::condition_variable notFull, notEmpty;
+
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+
+public:
+
+    /// <summary>
+    /// Creates a queue
+    /// </summary>
+    /// <param name="capacity">Maximum number of waiting items, at least 1</param>
+    explicit BoundedQueue(size_t capacity)
+        : capacity(capacity > 0 ? capacity : 1)
+    {
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    /// <summary>
+    /// Adds an item, waiting for a free slot
+    /// </summary>
+    /// <param name="item">Item to add</param>
+    /// <returns>False if the queue was closed and the item was dropped</returns>
+    bool push(T item)
+    {
+        {
+            std::unique_lock<std::mutex> lock(stateMutex);
+            notFull.wait(lock, [this]() { return closed || items.size() < capacity; });
+
+            if (closed)
+                return false;
+
+            items.push_back(std::move(item));
+        }
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /// <summary>
+    /// Takes the oldest item, waiting for one to arrive
+    /// </summary>
+    /// <param name="item">Receives the item</param>
+    /// <returns>False once the queue is closed and empty</returns>
+    bool pop(T& item)
+    {
+        {
+            std::unique_lock<std::mutex> lock(stateMutex);
+            notEmpty.wait(lock, [this]() { return closed || !items.empty(); });
+
+            if (items.empty())
+                return false;
+
+            item = std::move(items.front());
+            items.pop_front();
+        }
+        notFull.notify_one();
+        return true;
+    }
+
+    /// <summary>
+    /// Stops accepting items and wakes all waiting threads
+    /// </summary>
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            closed = true;
+        }
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+};
@@ -3,6 +3,13 @@
 #include <opencv.hpp>
 #include <vector>
 #include <cmath>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <limits>
+#include <algorithm>
+#include "ColorConverterSimd.h"
 
 /// <summary>
 /// Converter between BRG and Lab color spaces
@@ -19,19 +26,142 @@ public:
 	static cv::Mat BGR2Lab(const cv::Mat& bgrImage)
 	{
 		cv::Mat labImage(bgrImage.size(), CV_32FC3);
+		BGR2Lab(bgrImage, labImage, 0, bgrImage.rows);
+		return labImage;
+	}
 
-		for (int y = 0; y < bgrImage.rows; ++y)
-			for (int x = 0; x < bgrImage.cols; ++x)
+	/// <summary>
+	/// Converts a band of rows of a BGR image into a Lab image
+	/// </summary>
+	/// <param name="bgrImage">Input BGR image</param>
+	/// <param name="labImage">Allocated Lab image of the same size (CV_32FC3)</param>
+	/// <param name="rowBegin">First row</param>
+	/// <param name="rowEnd">Row after the last</param>
+	static void BGR2Lab(const cv::Mat& bgrImage, cv::Mat& labImage, int rowBegin, int rowEnd)
+	{
+		const float* linear = srgbDecodeTable();
+		bool simd = simdState();
+
+		for (int y = rowBegin; y < rowEnd; ++y)
+		{
+			int x = simd ? ColorConverterSimd::BGR2LabRow(bgrImage.ptr<uchar>(y), labImage.ptr<float>(y), bgrImage.cols, linear) : 0;
+
+			for (; x < bgrImage.cols; ++x)
 			{
 				cv::Vec3b bgr = bgrImage.at<cv::Vec3b>(y, x);
 
-				float b = bgr[0] / 255.0f, g = bgr[1] / 255.0f, r = bgr[2] / 255.0f, x_xyz, y_xyz, z_xyz;
-				RGB2XYZ(r, g, b, x_xyz, y_xyz, z_xyz);
+				float x_xyz, y_xyz, z_xyz;
+				LinearRGB2XYZ(linear[bgr[2]], linear[bgr[1]], linear[bgr[0]], x_xyz, y_xyz, z_xyz);
 
 				cv::Vec3f lab = XYZ2Lab(x_xyz, y_xyz, z_xyz);
 				labImage.at<cv::Vec3f>(y, x) = lab;
 			}
-		return labImage;
+		}
+	}
+
+	/// <summary>
+	/// Converts a band of rows of a BGR image into separate L, a, b planes,
+	/// without an interleaved Lab image in between
+	/// </summary>
+	/// <param name="bgrImage">Input BGR image</param>
+	/// <param name="l">Allocated L plane of the same size (CV_32F)</param>
+	/// <param name="a">Allocated a plane of the same size (CV_32F)</param>
+	/// <param name="b">Allocated b plane of the same size (CV_32F)</param>
+	/// <param name="rowBegin">First row</param>
+	/// <param name="rowEnd">Row after the last</param>
+	static void BGR2LabPlanes(const cv::Mat& bgrImage, cv::Mat& l, cv::Mat& a, cv::Mat& b, int rowBegin, int rowEnd)
+	{
+		const float* linear = srgbDecodeTable();
+		bool simd = simdState();
+
+		for (int y = rowBegin; y < rowEnd; ++y)
+		{
+			const uchar* src = bgrImage.ptr<uchar>(y);
+			float* rowL = l.ptr<float>(y);
+			float* rowA = a.ptr<float>(y);
+			float* rowB = b.ptr<float>(y);
+
+			int x = simd ? ColorConverterSimd::BGR2LabPlanarRow(src, rowL, rowA, rowB, bgrImage.cols, linear) : 0;
+
+			for (; x < bgrImage.cols; ++x)
+			{
+				float x_xyz, y_xyz, z_xyz;
+				LinearRGB2XYZ(linear[src[3 * x + 2]], linear[src[3 * x + 1]], linear[src[3 * x]], x_xyz, y_xyz, z_xyz);
+
+				cv::Vec3f lab = XYZ2Lab(x_xyz, y_xyz, z_xyz);
+				rowL[x] = lab[0];
+				rowA[x] = lab[1];
+				rowB[x] = lab[2];
+			}
+		}
+	}
+
+	/// <summary>
+	/// Computes only the L channel of a band of rows of a BGR image
+	/// </summary>
+	/// <param name="bgrImage">Input BGR image</param>
+	/// <param name="l">Allocated L plane of the same size (CV_32F)</param>
+	/// <param name="rowBegin">First row</param>
+	/// <param name="rowEnd">Row after the last</param>
+	static void BGR2Luminance(const cv::Mat& bgrImage, cv::Mat& l, int rowBegin, int rowEnd)
+	{
+		const float* linear = srgbDecodeTable();
+		bool simd = simdState();
+
+		for (int y = rowBegin; y < rowEnd; ++y)
+		{
+			const uchar* src = bgrImage.ptr<uchar>(y);
+			float* rowL = l.ptr<float>(y);
+
+			int x = simd ? ColorConverterSimd::BGR2LRow(src, rowL, bgrImage.cols, linear) : 0;
+
+			for (; x < bgrImage.cols; ++x)
+				rowL[x] = BGR2L(src + 3 * x, linear);
+		}
+	}
+
+	/// <summary>
+	/// Replaces the L channel of a band of rows of a BGR image and keeps a and b.
+	///
+	/// a and b are recomputed from the BGR pixel, which gives the same values
+	/// as a stored Lab image, so no Lab image or a/b planes are kept.
+	/// </summary>
+	/// <param name="bgrImage">Input BGR image</param>
+	/// <param name="l">New L plane (CV_32F)</param>
+	/// <param name="luminanceScale">Factor that brings l to the 0-255 L scale</param>
+	/// <param name="output">Allocated BGR image of the same size (CV_8UC3), may be bgrImage</param>
+	/// <param name="rowBegin">First row</param>
+	/// <param name="rowEnd">Row after the last</param>
+	static void ReplaceLuminance(const cv::Mat& bgrImage, const cv::Mat& l, float luminanceScale, cv::Mat& output, int rowBegin, int rowEnd)
+	{
+		const float* linear = srgbDecodeTable();
+		const float* encode = srgbEncodeTable();
+		bool simd = simdState();
+
+		for (int y = rowBegin; y < rowEnd; ++y)
+		{
+			const uchar* src = bgrImage.ptr<uchar>(y);
+			const float* rowL = l.ptr<float>(y);
+			uchar* dst = output.ptr<uchar>(y);
+
+			int x = simd ? ColorConverterSimd::ReplaceLuminanceRow(src, rowL, luminanceScale, dst, bgrImage.cols, linear, encode) : 0;
+
+			for (; x < bgrImage.cols; ++x)
+			{
+				float x_xyz, y_xyz, z_xyz;
+				LinearRGB2XYZ(linear[src[3 * x + 2]], linear[src[3 * x + 1]], linear[src[3 * x]], x_xyz, y_xyz, z_xyz);
+
+				cv::Vec3f lab = XYZ2Lab(x_xyz, y_xyz, z_xyz);
+				Lab2XYZ(rowL[x] * luminanceScale, lab[1], lab[2], x_xyz, y_xyz, z_xyz);
+
+				float r, g, b;
+				XYZ2LinearRGB(x_xyz, y_xyz, z_xyz, r, g, b);
+
+				dst[3 * x] = srgbEncode8(b, encode);
+				dst[3 * x + 1] = srgbEncode8(g, encode);
+				dst[3 * x + 2] = srgbEncode8(r, encode);
+			}
+		}
 	}
 
 	/// <summary>
@@ -42,9 +172,27 @@ public:
 	static cv::Mat Lab2BGR(const cv::Mat& labImage)
 	{
 		cv::Mat bgrImage(labImage.size(), CV_8UC3);
+		Lab2BGR(labImage, bgrImage, 0, labImage.rows);
+		return bgrImage;
+	}
 
-		for (int y = 0; y < labImage.rows; y++)
-			for (int x = 0; x < labImage.cols; x++)
+	/// <summary>
+	/// Converts a band of rows of a Lab image into a BGR image
+	/// </summary>
+	/// <param name="labImage">Input Lab image</param>
+	/// <param name="bgrImage">Allocated BGR image of the same size (CV_8UC3)</param>
+	/// <param name="rowBegin">First row</param>
+	/// <param name="rowEnd">Row after the last</param>
+	static void Lab2BGR(const cv::Mat& labImage, cv::Mat& bgrImage, int rowBegin, int rowEnd)
+	{
+		const float* encode = srgbEncodeTable();
+		bool simd = simdState();
+
+		for (int y = rowBegin; y < rowEnd; y++)
+		{
+			int x = simd ? ColorConverterSimd::Lab2BGRRow(labImage.ptr<float>(y), bgrImage.ptr<uchar>(y), labImage.cols, encode) : 0;
+
+			for (; x < labImage.cols; x++)
 			{
 				cv::Vec3f lab = labImage.at<cv::Vec3f>(y, x);
 
@@ -52,30 +200,74 @@ public:
 				Lab2XYZ(lab[0], lab[1], lab[2], x_xyz, y_xyz, z_xyz);
 
 				float r, g, b;
-				XYZ2RGB(x_xyz, y_xyz, z_xyz, r, g, b);
+				XYZ2LinearRGB(x_xyz, y_xyz, z_xyz, r, g, b);
 
-				bgrImage.at<cv::Vec3b>(y, x) = cv::Vec3b(saturate_cast(b * 255), saturate_cast(g * 255), saturate_cast(r * 255));
+				bgrImage.at<cv::Vec3b>(y, x) = cv::Vec3b(srgbEncode8(b, encode), srgbEncode8(g, encode), srgbEncode8(r, encode));
 			}
-		return bgrImage;
+		}
+	}
+
+	/// <summary>
+	/// Enables or disables the vector kernels.
+	/// They are enabled by default when the CPU supports them.
+	/// </summary>
+	/// <param name="enabled">False forces the scalar path</param>
+	static void setSimdEnabled(bool enabled)
+	{
+		simdState() = enabled && ColorConverterSimd::isSupported();
 	}
 
 private:
 
 	/// <summary>
-	/// Converts RGB to XYZ color space
+	/// Vector kernel switch, initialized by CPU feature detection
 	/// </summary>
-	/// <param name="r">Red Channel</param>
-	/// <param name="g">Green Channel</param>
-	/// <param name="b">Blue Channel</param>
+	/// <returns>Reference to the switch</returns>
+	static std::atomic<bool>& simdState()
+	{
+		static std::atomic<bool> enabled(ColorConverterSimd::isSupported());
+		return enabled;
+	}
+
+	/// <summary>
+	/// Removes the sRGB gamma from a channel value
+	/// </summary>
+	/// <param name="value">sRGB channel value (0-1)</param>
+	/// <returns>Linear channel value</returns>
+	static float srgbDecode(float value)
+	{
+		return (value > 0.04045f) ? pow((value + 0.055f) / 1.055f, 2.4f) : (value / 12.92f);
+	}
+
+	/// <summary>
+	/// Linear values of all 8-bit sRGB levels. 
+	/// Built once on first use, so BGR2Lab does no pow per pixel.
+	/// </summary>
+	/// <returns>Table of 256 linear values indexed by the 8-bit channel value</returns>
+	static const float* srgbDecodeTable()
+	{
+		static const std::array<float, 256> table = []()
+			{
+				std::array<float, 256> values;
+				for (int i = 0; i < 256; i++)
+					values[i] = srgbDecode(i / 255.0f);
+				return values;
+			}();
+
+		return table.data();
+	}
+
+	/// <summary>
+	/// Converts linear RGB to XYZ color space
+	/// </summary>
+	/// <param name="r">Linear red Channel</param>
+	/// <param name="g">Linear green Channel</param>
+	/// <param name="b">Linear blue Channel</param>
 	/// <param name="x">Output X channel</param>
 	/// <param name="y">Output Y channel</param>
 	/// <param name="z">Output Z channel</param>
-	static void RGB2XYZ(float r, float g, float b, float& x, float& y, float& z)
+	static void LinearRGB2XYZ(float r, float g, float b, float& x, float& y, float& z)
 	{
-		r = (r > 0.04045f) ? pow((r + 0.055f) / 1.055f, 2.4f) : (r / 12.92f);
-		g = (g > 0.04045f) ? pow((g + 0.055f) / 1.055f, 2.4f) : (g / 12.92f);
-		b = (b > 0.04045f) ? pow((b + 0.055f) / 1.055f, 2.4f) : (b / 12.92f);
-
 		x = r * 0.4124564f + g * 0.3575761f + b * 0.1804375f;
 		y = r * 0.2126729f + g * 0.7151522f + b * 0.0721750f;
 		z = r * 0.0193339f + g * 0.1191920f + b * 0.9503041f;
@@ -94,31 +286,85 @@ private:
 	/// <returns>Vector of Lab values</returns>
 	static cv::Vec3f XYZ2Lab(float x, float y, float z)
 	{
-		auto f = [](float t) -> float
-			{
-				const float delta = 6.0f / 29.0f;
-
-				if (t > pow(delta, 3))
-					return pow(t, 1.0f / 3.0f);
-				else
-					return t / (3 * delta * delta) + 4.0f / 29.0f;
-			};
-
 		const float xn = 0.95047f;
-		const float yn = 1.00000f;
 		const float zn = 1.08883f;
 
-		float l = 116.0f * f(y / yn) - 16.0f;
-		float a = 500.0f * (f(x / xn) - f(y / yn));
-		float b = 200.0f * (f(y / yn) - f(z / zn));
+		float fy = labF(y / 1.00000f);
+
+		float l = fy2L(fy);
+		float a = 500.0f * (labF(x / xn) - fy);
+		float b = 200.0f * (fy - labF(z / zn));
 
-		l = l * 255.0f / 100.0f;
 		a = a + 128.0f;
 		b = b + 128.0f;
 
 		return cv::Vec3f(l, a, b);
 	}
 
+	/// <summary>
+	/// Lab companding function f(t)
+	/// </summary>
+	/// <param name="t">Normalized X, Y or Z</param>
+	/// <returns>f(t)</returns>
+	static float labF(float t)
+	{
+		const float delta = 6.0f / 29.0f;
+		const float deltaCube = delta * delta * delta;
+
+		if (t > deltaCube)
+			return fastCbrt(t);
+		else
+			return t / (3 * delta * delta) + 4.0f / 29.0f;
+	}
+
+	/// <summary>
+	/// L on the 0-255 scale from f(Y)
+	/// </summary>
+	/// <param name="fy">f(Y / Yn)</param>
+	/// <returns>L channel</returns>
+	static float fy2L(float fy)
+	{
+		float l = 116.0f * fy - 16.0f;
+		return l * 255.0f / 100.0f;
+	}
+
+	/// <summary>
+	/// L on the 0-255 scale of a BGR pixel, the Y row of LinearRGB2XYZ followed by XYZ2Lab
+	/// </summary>
+	/// <param name="pixel">B, G, R bytes</param>
+	/// <param name="linear">sRGB decode table</param>
+	/// <returns>L channel</returns>
+	static float BGR2L(const uchar* pixel, const float* linear)
+	{
+		float y = linear[pixel[2]] * 0.2126729f + linear[pixel[1]] * 0.7151522f + linear[pixel[0]] * 0.0721750f;
+		return fy2L(labF(y / 1.00000f));
+	}
+
+	/// <summary>
+	/// Fast cube root for the Lab forward transform.
+	///
+	/// The seed divides the float exponent by 3 through the bit pattern,
+	/// then two Newton steps refine it. On the f(t) domain (0.0089 - 1.1)
+	/// the absolute error against pow(t, 1/3) is at most 1.6e-6, which is
+	/// at most 5e-4 on L (0-255 scale) and 2e-3 on a and b.
+	/// </summary>
+	/// <param name="t">Positive value</param>
+	/// <returns>Cube root of t</returns>
+	static float fastCbrt(float t)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &t, sizeof(bits));
+		bits = bits / 3 + 709921077u;
+
+		float root;
+		std::memcpy(&root, &bits, sizeof(root));
+
+		root = (2.0f * root + t / (root * root)) * (1.0f / 3.0f);
+		root = (2.0f * root + t / (root * root)) * (1.0f / 3.0f);
+
+		return root;
+	}
+
 	/// <summary>
 	/// Converts Lab to XYZ color space
 	/// </summary>
@@ -157,15 +403,15 @@ private:
 	}
 
 	/// <summary>
-	/// Converts XYZ to RGB color space
+	/// Converts XYZ to linear RGB, gamma is applied by srgbEncode8
 	/// </summary>
 	/// <param name="x">X channel</param>
 	/// <param name="y">Y channel</param>
 	/// <param name="z">Z channel</param>
-	/// <param name="r">Output red channel</param>
-	/// <param name="g">Output green channel</param>
-	/// <param name="b">Output blue channel</param>
-	static void XYZ2RGB(float x, float y, float z, float& r, float& g, float& b)
+	/// <param name="r">Output linear red channel</param>
+	/// <param name="g">Output linear green channel</param>
+	/// <param name="b">Output linear blue channel</param>
+	static void XYZ2LinearRGB(float x, float y, float z, float& r, float& g, float& b)
 	{
 		x *= 0.95047f;
 		y *= 1.00000f;
@@ -174,14 +420,87 @@ private:
 		r = x * 3.2404542f + y * -1.5371385f + z * -0.4985314f;
 		g = x * -0.9692660f + y * 1.8760108f + z * 0.0415560f;
 		b = x * 0.0556434f + y * -0.2040259f + z * 1.0572252f;
+	}
+
+	/// <summary>
+	/// sRGB gamma of a linear value, clamped to 0-1
+	/// </summary>
+	/// <param name="value">Linear value</param>
+	/// <returns>Encoded value</returns>
+	static float srgbEncode(float value)
+	{
+		value = (value > 0.0031308f) ? (1.055f * pow(value, 1.0f / 2.4f) - 0.055f) : (12.92f * value);
+		return cv::max(0.0f, cv::min(1.0f, value));
+	}
+
+	/// <summary>
+	/// 8-bit sRGB code of a linear value through srgbEncodeTable
+	/// </summary>
+	/// <param name="value">Linear value</param>
+	/// <param name="table">Result of srgbEncodeTable</param>
+	/// <returns>Same code as saturate_cast(srgbEncode(value) * 255)</returns>
+	static uchar srgbEncode8(float value, const float* table)
+	{
+		const int size = ColorConverterSimd::encodeTableSize;
+
+		float position = value * size;
+		int cell = (position <= 0.0f) ? 0 : (position < size) ? (int)position : size - 1;
+
+		return (uchar)(table[cell] + ((value < table[size + cell]) ? 0.0f : 1.0f));
+	}
+
+	/// <summary>
+	/// Linear to 8-bit sRGB table that replaces pow in the back conversion.
+	///
+	/// The 0-1 range is split into encodeTableSize equal cells. The code
+	/// saturate_cast(srgbEncode(v) * 255) is monotonic in v and rises by less
+	/// than one level per cell (at most 12.92 * 255 / 4096 = 0.81 on the
+	/// linear segment, less on the curve), so each cell holds its first code
+	/// and the smallest float at which the code steps up, found by bisection
+	/// over float bit patterns. Lookup then gives the pow result exactly;
+	/// this was checked for every float in -0.01 - 1.01.
+	/// Built once on first use.
+	/// </summary>
+	/// <returns>Codes of the cells followed by their thresholds</returns>
+	static const float* srgbEncodeTable()
+	{
+		static const std::vector<float> table = []()
+			{
+				const int size = ColorConverterSimd::encodeTableSize;
+				auto code = [](float v) { return (int)saturate_cast(srgbEncode(v) * 255); };
+				auto bitsOf = [](float v) { uint32_t bits; std::memcpy(&bits, &v, sizeof(bits)); return bits; };
+				auto floatOf = [](uint32_t bits) { float v; std::memcpy(&v, &bits, sizeof(v)); return v; };
+
+				std::vector<float> values(2 * size);
+				for (int i = 0; i < size; i++)
+				{
+					float low = (float)i / size;
+					// The last cell also covers values above 1
+					float high = (i + 1 < size) ? (float)(i + 1) / size : 2.0f;
+					int first = code(low);
+
+					values[i] = (float)first;
+					values[size + i] = std::numeric_limits<float>::infinity();
+
+					if (code(high) == first)
+						continue;
 
-		r = (r > 0.0031308f) ? (1.055f * pow(r, 1.0f / 2.4f) - 0.055f) : (12.92f * r);
-		g = (g > 0.0031308f) ? (1.055f * pow(g, 1.0f / 2.4f) - 0.055f) : (12.92f * g);
-		b = (b > 0.0031308f) ? (1.055f * pow(b, 1.0f / 2.4f) - 0.055f) : (12.92f * b);
+					// low keeps the first code, high is above it
+					uint32_t lowBits = bitsOf(low), highBits = bitsOf(high);
+					while (highBits - lowBits > 1)
+					{
+						uint32_t middle = lowBits + (highBits - lowBits) / 2;
+						if (code(floatOf(middle)) > first)
+							highBits = middle;
+						else
+							lowBits = middle;
+					}
+					values[size + i] = floatOf(highBits);
+				}
+				return values;
+			}();
 
-		r = cv::max(0.0f, cv::min(1.0f, r));
-		g = cv::max(0.0f, cv::min(1.0f, g));
-		b = cv::max(0.0f, cv::min(1.0f, b));
+		return table.data();
 	}
 
 	/// <summary>
@@ -0,0 +1,634 @@
+#pragma once
+
+#include <opencv.hpp>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define COLOR_CONVERTER_SIMD_AVX2
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define COLOR_CONVERTER_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+// GCC and Clang only emit AVX2/FMA code in functions that ask for it;
+// MSVC accepts the intrinsics anywhere, so the baseline build stays portable
+#if defined(COLOR_CONVERTER_SIMD_AVX2) && (defined(__GNUC__) || defined(__clang__))
+#define COLOR_CONVERTER_SIMD_TARGET __attribute__((target("avx2,fma")))
+#else
+#define COLOR_CONVERTER_SIMD_TARGET
+#endif
+
+/// <summary>
+/// Vectorized row kernels for ColorConverter.
+///
+/// The kernels are written once against a small set of vector operations
+/// implemented for AVX2 + FMA (8 pixels per step, selected at runtime by CPU
+/// feature detection) and NEON (4 pixels per step, always present on AArch64).
+/// Each kernel converts the whole row: the last partial vector goes through
+/// a zero-padded buffer, so a pixel gets the same result wherever it lies in
+/// the row and tiles of an image convert exactly like the full image.
+///
+/// Cube roots use the same bit-seeded Newton iteration as the scalar path and
+/// sRGB encoding uses the same table (see ColorConverter::srgbEncodeTable).
+/// Lab values stay within 2e-4 of the scalar path (checked over all 2^24 BGR
+/// colors) and 8-bit output within one level, because FMA rounding can move
+/// a linear value across a table threshold.
+/// </summary>
+class ColorConverterSimd
+{
+public:
+
+    /// <summary>
+    /// Cells of the linear to 8-bit sRGB table over 0-1.
+    /// The table holds encodeTableSize codes followed by encodeTableSize thresholds.
+    /// </summary>
+    static const int encodeTableSize = 4096;
+
+    /// <summary>
+    /// Checks if the running CPU supports the vector kernels
+    /// </summary>
+    /// <returns>True if BGR2LabRow and Lab2BGRRow process pixels</returns>
+    static bool isSupported()
+    {
+#if defined(COLOR_CONVERTER_SIMD_AVX2)
+        return cv::checkHardwareSupport(CV_CPU_AVX2) && cv::checkHardwareSupport(CV_CPU_FMA3);
+#elif defined(COLOR_CONVERTER_SIMD_NEON)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /// <summary>
+    /// Converts a row prefix from BGR to Lab. Requires isSupported().
+    /// </summary>
+    /// <param name="src">BGR pixels (3 bytes each)</param>
+    /// <param name="dst">Lab pixels (3 floats each)</param>
+    /// <param name="count">Pixels in the row</param>
+    /// <param name="decodeTable">sRGB to linear table of 256 entries</param>
+    /// <returns>Number of converted pixels from the row start (the whole row when supported)</returns>
+    static int BGR2LabRow(const uchar* src, float* dst, int count, const float* decodeTable)
+    {
+#if defined(COLOR_CONVERTER_SIMD_AVX2)
+        return BGR2LabKernel<Avx2>(src, dst, count, decodeTable);
+#elif defined(COLOR_CONVERTER_SIMD_NEON)
+        return BGR2LabKernel<Neon>(src, dst, count, decodeTable);
+#else
+        return 0;
+#endif
+    }
+
+    /// <summary>
+    /// Converts a row prefix from BGR to separate L, a, b rows. Requires isSupported().
+    /// </summary>
+    /// <param name="src">BGR pixels (3 bytes each)</param>
+    /// <param name="dstL">L values</param>
+    /// <param name="dstA">a values</param>
+    /// <param name="dstB">b values</param>
+    /// <param name="count">Pixels in the row</param>
+    /// <param name="decodeTable">sRGB to linear table of 256 entries</param>
+    /// <returns>Number of converted pixels from the row start (the whole row when supported)</returns>
+    static int BGR2LabPlanarRow(const uchar* src, float* dstL, float* dstA, float* dstB, int count, const float* decodeTable)
+    {
+#if defined(COLOR_CONVERTER_SIMD_AVX2)
+        return BGR2LabPlanarKernel<Avx2>(src, dstL, dstA, dstB, count, decodeTable);
+#elif defined(COLOR_CONVERTER_SIMD_NEON)
+        return BGR2LabPlanarKernel<Neon>(src, dstL, dstA, dstB, count, decodeTable);
+#else
+        return 0;
+#endif
+    }
+
+    /// <summary>
+    /// Converts a row prefix from BGR to L only. Requires isSupported().
+    /// </summary>
+    /// <param name="src">BGR pixels (3 bytes each)</param>
+    /// <param name="dst">L values</param>
+    /// <param name="count">Pixels in the row</param>
+    /// <param name="decodeTable">sRGB to linear table of 256 entries</param>
+    /// <returns>Number of converted pixels from the row start (the whole row when supported)</returns>
+    static int BGR2LRow(const uchar* src, float* dst, int count, const float* decodeTable)
+    {
+#if defined(COLOR_CONVERTER_SIMD_AVX2)
+        return BGR2LKernel<Avx2>(src, dst, count, decodeTable);
+#elif defined(COLOR_CONVERTER_SIMD_NEON)
+        return BGR2LKernel<Neon>(src, dst, count, decodeTable);
+#else
+        return 0;
+#endif
+    }
+
+    /// <summary>
+    /// Replaces L of a BGR row prefix, keeping the a and b of every pixel. Requires isSupported().
+    /// </summary>
+    /// <param name="src">BGR pixels (3 bytes each)</param>
+    /// <param name="luminance">New L values before scaling</param>
+    /// <param name="luminanceScale">Factor that brings luminance to the 0-255 L scale</param>
+    /// <param name="dst">BGR pixels (3 bytes each), may be src</param>
+    /// <param name="count">Pixels in the row</param>
+    /// <param name="decodeTable">sRGB to linear table of 256 entries</param>
+    /// <param name="encodeTable">Linear to 8-bit sRGB table, see encodeTableSize</param>
+    /// <returns>Number of converted pixels from the row start (the whole row when supported)</returns>
+    static int ReplaceLuminanceRow(const uchar* src, const float* luminance, float luminanceScale, uchar* dst, int count, const float* decodeTable, const float* encodeTable)
+    {
+#if defined(COLOR_CONVERTER_SIMD_AVX2)
+        return ReplaceLuminanceKernel<Avx2>(src, luminance, luminanceScale, dst, count, decodeTable, encodeTable);
+#elif defined(COLOR_CONVERTER_SIMD_NEON)
+        return ReplaceLuminanceKernel<Neon>(src, luminance, luminanceScale, dst, count, decodeTable, encodeTable);
+#else
+        return 0;
+#endif
+    }
+
+    /// <summary>
+    /// Converts a row prefix from Lab to BGR. Requires isSupported().
+    /// </summary>
+    /// <param name="src">Lab pixels (3 floats each)</param>
+    /// <param name="dst">BGR pixels (3 bytes each)</param>
+    /// <param name="count">Pixels in the row</param>
+    /// <param name="encodeTable">Linear to 8-bit sRGB table, see encodeTableSize</param>
+    /// <returns>Number of converted pixels from the row start (the whole row when supported)</returns>
+    static int Lab2BGRRow(const float* src, uchar* dst, int count, const float* encodeTable)
+    {
+#if defined(COLOR_CONVERTER_SIMD_AVX2)
+        return Lab2BGRKernel<Avx2>(src, dst, count, encodeTable);
+#elif defined(COLOR_CONVERTER_SIMD_NEON)
+        return Lab2BGRKernel<Neon>(src, dst, count, encodeTable);
+#else
+        return 0;
+#endif
+    }
+
+private:
+
+#if defined(COLOR_CONVERTER_SIMD_AVX2)
+
+    /// <summary>
+    /// AVX2 + FMA operations, 8 lanes
+    /// </summary>
+    struct Avx2
+    {
+        typedef __m256 F;
+        static const int width = 8;
+
+        COLOR_CONVERTER_SIMD_TARGET static F set(float v) { return _mm256_set1_ps(v); }
+        COLOR_CONVERTER_SIMD_TARGET static F load(const float* src) { return _mm256_loadu_ps(src); }
+        COLOR_CONVERTER_SIMD_TARGET static void store(float* dst, F v) { _mm256_storeu_ps(dst, v); }
+        COLOR_CONVERTER_SIMD_TARGET static F add(F a, F b) { return _mm256_add_ps(a, b); }
+        COLOR_CONVERTER_SIMD_TARGET static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+        COLOR_CONVERTER_SIMD_TARGET static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+        COLOR_CONVERTER_SIMD_TARGET static F div(F a, F b) { return _mm256_div_ps(a, b); }
+        COLOR_CONVERTER_SIMD_TARGET static F fma(F a, F b, F c) { return _mm256_fmadd_ps(a, b, c); }
+        COLOR_CONVERTER_SIMD_TARGET static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+        COLOR_CONVERTER_SIMD_TARGET static F min(F a, F b) { return _mm256_min_ps(a, b); }
+        COLOR_CONVERTER_SIMD_TARGET static F max(F a, F b) { return _mm256_max_ps(a, b); }
+
+        /// <summary>Per lane: a > b ? ifTrue : ifFalse</summary>
+        COLOR_CONVERTER_SIMD_TARGET static F selectGreater(F a, F b, F ifTrue, F ifFalse)
+        {
+            return _mm256_blendv_ps(ifFalse, ifTrue, _mm256_cmp_ps(a, b, _CMP_GT_OQ));
+        }
+
+        /// <summary>Exponent / 3 seed of the cube root, see ColorConverter::fastCbrt</summary>
+        COLOR_CONVERTER_SIMD_TARGET static F cbrtSeed(F t)
+        {
+            // bits / 3 through a float multiply: the lost low bits are far below the seed error
+            __m256i bits = _mm256_castps_si256(t);
+            bits = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(bits), _mm256_set1_ps(1.0f / 3.0f)));
+            return _mm256_castsi256_ps(_mm256_add_epi32(bits, _mm256_set1_epi32(709921077)));
+        }
+
+        COLOR_CONVERTER_SIMD_TARGET static void loadLab(const float* src, F& l, F& a, F& b)
+        {
+            // Two 4-pixel halves per register, then three shuffles split the channels
+            __m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(src)), _mm_loadu_ps(src + 12), 1);
+            __m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(src + 4)), _mm_loadu_ps(src + 16), 1);
+            __m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(src + 8)), _mm_loadu_ps(src + 20), 1);
+
+            __m256 xy = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));
+            __m256 yz = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));
+            l = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+            a = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+            b = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
+        }
+
+        COLOR_CONVERTER_SIMD_TARGET static void storeLab(float* dst, F l, F a, F b)
+        {
+            __m256 la = _mm256_shuffle_ps(l, a, _MM_SHUFFLE(2, 0, 2, 0));
+            __m256 ab = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            __m256 bl = _mm256_shuffle_ps(b, l, _MM_SHUFFLE(3, 1, 2, 0));
+            __m256 r03 = _mm256_shuffle_ps(la, bl, _MM_SHUFFLE(2, 0, 2, 0));
+            __m256 r14 = _mm256_shuffle_ps(ab, la, _MM_SHUFFLE(3, 1, 2, 0));
+            __m256 r25 = _mm256_shuffle_ps(bl, ab, _MM_SHUFFLE(3, 1, 3, 1));
+
+            _mm_storeu_ps(dst, _mm256_castps256_ps128(r03));
+            _mm_storeu_ps(dst + 4, _mm256_castps256_ps128(r14));
+            _mm_storeu_ps(dst + 8, _mm256_castps256_ps128(r25));
+            _mm_storeu_ps(dst + 12, _mm256_extractf128_ps(r03, 1));
+            _mm_storeu_ps(dst + 16, _mm256_extractf128_ps(r14, 1));
+            _mm_storeu_ps(dst + 20, _mm256_extractf128_ps(r25, 1));
+        }
+
+        /// <summary>Deinterleaves 8 BGR pixels and decodes them through the table</summary>
+        COLOR_CONVERTER_SIMD_TARGET static void loadBGRLinear(const uchar* src, const float* table, F& b, F& g, F& r)
+        {
+            // Bytes 0-7 come from the first load, bytes 8-23 from the second
+            __m128i lo = _mm_loadu_si128((const __m128i*)src);
+            __m128i hi = _mm_loadu_si128((const __m128i*)(src + 8));
+
+            __m128i bb = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(0, 3, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1)));
+            __m128i gg = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(1, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1)));
+            __m128i rr = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(2, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1)));
+
+            b = _mm256_i32gather_ps(table, _mm256_cvtepu8_epi32(bb), 4);
+            g = _mm256_i32gather_ps(table, _mm256_cvtepu8_epi32(gg), 4);
+            r = _mm256_i32gather_ps(table, _mm256_cvtepu8_epi32(rr), 4);
+        }
+
+        /// <summary>Reads table[i] and table[size + i] for i = trunc(position) clamped to 0 - size-1</summary>
+        COLOR_CONVERTER_SIMD_TARGET static void lookup(const float* table, int size, F position, F& first, F& second)
+        {
+            __m256i index = _mm256_min_epi32(_mm256_max_epi32(_mm256_cvttps_epi32(position), _mm256_setzero_si256()), _mm256_set1_epi32(size - 1));
+            first = _mm256_i32gather_ps(table, index, 4);
+            second = _mm256_i32gather_ps(table + size, index, 4);
+        }
+
+        /// <summary>Truncates 0-255 values to bytes and interleaves them as 8 BGR pixels</summary>
+        COLOR_CONVERTER_SIMD_TARGET static void storeBGR(uchar* dst, F b, F g, F r)
+        {
+            __m128i bb = packBytes(_mm256_cvttps_epi32(b));
+            __m128i gg = packBytes(_mm256_cvttps_epi32(g));
+            __m128i rr = packBytes(_mm256_cvttps_epi32(r));
+            __m128i bg = _mm_unpacklo_epi64(bb, gg);
+
+            __m128i first = _mm_or_si128(_mm_shuffle_epi8(bg, _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5)),
+                _mm_shuffle_epi8(rr, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+            __m128i second = _mm_or_si128(_mm_shuffle_epi8(bg, _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                _mm_shuffle_epi8(rr, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1)));
+
+            _mm_storeu_si128((__m128i*)dst, first);
+            _mm_storel_epi64((__m128i*)(dst + 16), second);
+        }
+
+        /// <summary>Packs 8 int32 lanes (0-255) into the low 8 bytes</summary>
+        COLOR_CONVERTER_SIMD_TARGET static __m128i packBytes(__m256i v)
+        {
+            __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+            return _mm_packus_epi16(words, words);
+        }
+    };
+
+#endif
+
+#if defined(COLOR_CONVERTER_SIMD_NEON)
+
+    /// <summary>
+    /// NEON operations, 4 lanes
+    /// </summary>
+    struct Neon
+    {
+        typedef float32x4_t F;
+        static const int width = 4;
+
+        static F set(float v) { return vdupq_n_f32(v); }
+        static F load(const float* src) { return vld1q_f32(src); }
+        static void store(float* dst, F v) { vst1q_f32(dst, v); }
+        static F add(F a, F b) { return vaddq_f32(a, b); }
+        static F sub(F a, F b) { return vsubq_f32(a, b); }
+        static F mul(F a, F b) { return vmulq_f32(a, b); }
+        static F div(F a, F b) { return vdivq_f32(a, b); }
+        static F fma(F a, F b, F c) { return vfmaq_f32(c, a, b); }
+        static F sqrt(F a) { return vsqrtq_f32(a); }
+        static F min(F a, F b) { return vminq_f32(a, b); }
+        static F max(F a, F b) { return vmaxq_f32(a, b); }
+
+        /// <summary>Per lane: a > b ? ifTrue : ifFalse</summary>
+        static F selectGreater(F a, F b, F ifTrue, F ifFalse)
+        {
+            return vbslq_f32(vcgtq_f32(a, b), ifTrue, ifFalse);
+        }
+
+        /// <summary>Exponent / 3 seed of the cube root, see ColorConverter::fastCbrt</summary>
+        static F cbrtSeed(F t)
+        {
+            int32x4_t bits = vreinterpretq_s32_f32(t);
+            bits = vcvtnq_s32_f32(vmulq_f32(vcvtq_f32_s32(bits), vdupq_n_f32(1.0f / 3.0f)));
+            return vreinterpretq_f32_s32(vaddq_s32(bits, vdupq_n_s32(709921077)));
+        }
+
+        static void loadLab(const float* src, F& l, F& a, F& b)
+        {
+            float32x4x3_t lab = vld3q_f32(src);
+            l = lab.val[0];
+            a = lab.val[1];
+            b = lab.val[2];
+        }
+
+        static void storeLab(float* dst, F l, F a, F b)
+        {
+            float32x4x3_t lab;
+            lab.val[0] = l;
+            lab.val[1] = a;
+            lab.val[2] = b;
+            vst3q_f32(dst, lab);
+        }
+
+        /// <summary>Deinterleaves 4 BGR pixels and decodes them through the table</summary>
+        static void loadBGRLinear(const uchar* src, const float* table, F& b, F& g, F& r)
+        {
+            float lb[4], lg[4], lr[4];
+            for (int i = 0; i < 4; i++)
+            {
+                lb[i] = table[src[3 * i]];
+                lg[i] = table[src[3 * i + 1]];
+                lr[i] = table[src[3 * i + 2]];
+            }
+            b = vld1q_f32(lb);
+            g = vld1q_f32(lg);
+            r = vld1q_f32(lr);
+        }
+
+        /// <summary>Reads table[i] and table[size + i] for i = trunc(position) clamped to 0 - size-1</summary>
+        static void lookup(const float* table, int size, F position, F& first, F& second)
+        {
+            int32_t index[4];
+            vst1q_s32(index, vminq_s32(vmaxq_s32(vcvtq_s32_f32(position), vdupq_n_s32(0)), vdupq_n_s32(size - 1)));
+
+            float lf[4], ls[4];
+            for (int i = 0; i < 4; i++)
+            {
+                lf[i] = table[index[i]];
+                ls[i] = table[size + index[i]];
+            }
+            first = vld1q_f32(lf);
+            second = vld1q_f32(ls);
+        }
+
+        /// <summary>Truncates 0-255 values to bytes and interleaves them as 4 BGR pixels</summary>
+        static void storeBGR(uchar* dst, F b, F g, F r)
+        {
+            uint32_t vb[4], vg[4], vr[4];
+            vst1q_u32(vb, vcvtq_u32_f32(b));
+            vst1q_u32(vg, vcvtq_u32_f32(g));
+            vst1q_u32(vr, vcvtq_u32_f32(r));
+            for (int i = 0; i < 4; i++)
+            {
+                dst[3 * i] = (uchar)vb[i];
+                dst[3 * i + 1] = (uchar)vg[i];
+                dst[3 * i + 2] = (uchar)vr[i];
+            }
+        }
+    };
+
+#endif
+
+    /// <summary>
+    /// Cube root of positive lanes: bit seed and two Newton steps
+    /// </summary>
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static typename V::F cbrt(typename V::F t)
+    {
+        typename V::F root = V::cbrtSeed(t), third = V::set(1.0f / 3.0f);
+
+        root = V::mul(V::add(V::add(root, root), V::div(t, V::mul(root, root))), third);
+        root = V::mul(V::add(V::add(root, root), V::div(t, V::mul(root, root))), third);
+
+        return root;
+    }
+
+    /// <summary>
+    /// Lab f(t): cube root above (6/29)^3, linear segment below
+    /// </summary>
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static typename V::F labF(typename V::F t)
+    {
+        const float delta = 6.0f / 29.0f;
+
+        typename V::F linear = V::fma(t, V::set(1.0f / (3 * delta * delta)), V::set(4.0f / 29.0f));
+        return V::selectGreater(t, V::set(delta * delta * delta), cbrt<V>(t), linear);
+    }
+
+    /// <summary>
+    /// Inverse of labF: cube above 6/29, linear segment below
+    /// </summary>
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static typename V::F labFInverse(typename V::F t)
+    {
+        const float delta = 6.0f / 29.0f;
+
+        typename V::F linear = V::mul(V::set(3 * delta * delta), V::sub(t, V::set(4.0f / 29.0f)));
+        return V::selectGreater(t, V::set(delta), V::mul(V::mul(t, t), t), linear);
+    }
+
+    /// <summary>
+    /// 8-bit sRGB code of a linear value: the cell code, plus one at or above the cell threshold
+    /// </summary>
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static typename V::F srgbEncode8(typename V::F v, const float* encodeTable)
+    {
+        typename V::F code, threshold;
+        V::lookup(encodeTable, encodeTableSize, V::mul(v, V::set((float)encodeTableSize)), code, threshold);
+
+        return V::add(code, V::selectGreater(threshold, v, V::set(0.0f), V::set(1.0f)));
+    }
+
+    /// <summary>
+    /// Converts one vector of BGR pixels to L, a, b lanes
+    /// </summary>
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static void BGR2LabVector(const uchar* src, const float* decodeTable, typename V::F& l, typename V::F& a, typename V::F& bb)
+    {
+        typedef typename V::F F;
+
+        F b, g, r;
+        V::loadBGRLinear(src, decodeTable, b, g, r);
+
+        F fx = labF<V>(V::div(V::div(V::fma(b, V::set(0.1804375f), V::fma(g, V::set(0.3575761f), V::mul(r, V::set(0.4124564f)))), V::set(0.95047f)), V::set(0.95047f)));
+        F fy = labF<V>(V::fma(b, V::set(0.0721750f), V::fma(g, V::set(0.7151522f), V::mul(r, V::set(0.2126729f)))));
+        F fz = labF<V>(V::div(V::div(V::fma(b, V::set(0.9503041f), V::fma(g, V::set(0.1191920f), V::mul(r, V::set(0.0193339f)))), V::set(1.08883f)), V::set(1.08883f)));
+
+        l = V::mul(V::fma(V::set(116.0f), fy, V::set(-16.0f)), V::set(255.0f / 100.0f));
+        a = V::fma(V::set(500.0f), V::sub(fx, fy), V::set(128.0f));
+        bb = V::fma(V::set(200.0f), V::sub(fy, fz), V::set(128.0f));
+    }
+
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static int BGR2LabKernel(const uchar* src, float* dst, int count, const float* decodeTable)
+    {
+        int x = 0;
+
+        for (; x + V::width <= count; x += V::width)
+        {
+            typename V::F l, a, b;
+            BGR2LabVector<V>(src + 3 * x, decodeTable, l, a, b);
+            V::storeLab(dst + 3 * x, l, a, b);
+        }
+
+        if (x < count)
+        {
+            uchar in[3 * V::width] = {};
+            float out[3 * V::width];
+            std::memcpy(in, src + 3 * x, 3 * (count - x));
+
+            typename V::F l, a, b;
+            BGR2LabVector<V>(in, decodeTable, l, a, b);
+            V::storeLab(out, l, a, b);
+            std::memcpy(dst + 3 * x, out, 3 * (count - x) * sizeof(float));
+        }
+
+        return count;
+    }
+
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static int BGR2LabPlanarKernel(const uchar* src, float* dstL, float* dstA, float* dstB, int count, const float* decodeTable)
+    {
+        int x = 0;
+
+        for (; x + V::width <= count; x += V::width)
+        {
+            typename V::F l, a, b;
+            BGR2LabVector<V>(src + 3 * x, decodeTable, l, a, b);
+            V::store(dstL + x, l);
+            V::store(dstA + x, a);
+            V::store(dstB + x, b);
+        }
+
+        if (x < count)
+        {
+            uchar in[3 * V::width] = {};
+            float outL[V::width], outA[V::width], outB[V::width];
+            std::memcpy(in, src + 3 * x, 3 * (count - x));
+
+            typename V::F l, a, b;
+            BGR2LabVector<V>(in, decodeTable, l, a, b);
+            V::store(outL, l);
+            V::store(outA, a);
+            V::store(outB, b);
+            std::memcpy(dstL + x, outL, (count - x) * sizeof(float));
+            std::memcpy(dstA + x, outA, (count - x) * sizeof(float));
+            std::memcpy(dstB + x, outB, (count - x) * sizeof(float));
+        }
+
+        return count;
+    }
+
+    /// <summary>
+    /// Converts one vector of BGR pixels to L lanes only
+    /// </summary>
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static typename V::F BGR2LVector(const uchar* src, const float* decodeTable)
+    {
+        typedef typename V::F F;
+
+        F b, g, r;
+        V::loadBGRLinear(src, decodeTable, b, g, r);
+
+        F fy = labF<V>(V::fma(b, V::set(0.0721750f), V::fma(g, V::set(0.7151522f), V::mul(r, V::set(0.2126729f)))));
+        return V::mul(V::fma(V::set(116.0f), fy, V::set(-16.0f)), V::set(255.0f / 100.0f));
+    }
+
+    /// <summary>
+    /// Converts one vector of L, a, b lanes to BGR pixels and stores them
+    /// </summary>
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static void Lab2BGRVector(typename V::F l, typename V::F a, typename V::F b, uchar* dst, const float* encodeTable)
+    {
+        typedef typename V::F F;
+
+        F fy = V::div(V::fma(l, V::set(100.0f / 255.0f), V::set(16.0f)), V::set(116.0f));
+        F fx = V::fma(V::sub(a, V::set(128.0f)), V::set(1.0f / 500.0f), fy);
+        F fz = V::fma(V::sub(b, V::set(128.0f)), V::set(-1.0f / 200.0f), fy);
+
+        // White point applied twice, as in Lab2XYZ followed by XYZ2RGB
+        F xx = V::mul(labFInverse<V>(fx), V::set(0.95047f * 0.95047f));
+        F yy = labFInverse<V>(fy);
+        F zz = V::mul(labFInverse<V>(fz), V::set(1.08883f * 1.08883f));
+
+        F rr = V::fma(zz, V::set(-0.4985314f), V::fma(yy, V::set(-1.5371385f), V::mul(xx, V::set(3.2404542f))));
+        F gg = V::fma(zz, V::set(0.0415560f), V::fma(yy, V::set(1.8760108f), V::mul(xx, V::set(-0.9692660f))));
+        F bb = V::fma(zz, V::set(1.0572252f), V::fma(yy, V::set(-0.2040259f), V::mul(xx, V::set(0.0556434f))));
+
+        V::storeBGR(dst, srgbEncode8<V>(bb, encodeTable), srgbEncode8<V>(gg, encodeTable), srgbEncode8<V>(rr, encodeTable));
+    }
+
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static int BGR2LKernel(const uchar* src, float* dst, int count, const float* decodeTable)
+    {
+        int x = 0;
+
+        for (; x + V::width <= count; x += V::width)
+            V::store(dst + x, BGR2LVector<V>(src + 3 * x, decodeTable));
+
+        if (x < count)
+        {
+            uchar in[3 * V::width] = {};
+            float out[V::width];
+            std::memcpy(in, src + 3 * x, 3 * (count - x));
+
+            V::store(out, BGR2LVector<V>(in, decodeTable));
+            std::memcpy(dst + x, out, (count - x) * sizeof(float));
+        }
+
+        return count;
+    }
+
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static int Lab2BGRKernel(const float* src, uchar* dst, int count, const float* encodeTable)
+    {
+        int x = 0;
+
+        for (; x + V::width <= count; x += V::width)
+        {
+            typename V::F l, a, b;
+            V::loadLab(src + 3 * x, l, a, b);
+            Lab2BGRVector<V>(l, a, b, dst + 3 * x, encodeTable);
+        }
+
+        if (x < count)
+        {
+            float in[3 * V::width] = {};
+            uchar out[3 * V::width];
+            std::memcpy(in, src + 3 * x, 3 * (count - x) * sizeof(float));
+
+            typename V::F l, a, b;
+            V::loadLab(in, l, a, b);
+            Lab2BGRVector<V>(l, a, b, out, encodeTable);
+            std::memcpy(dst + 3 * x, out, 3 * (count - x));
+        }
+
+        return count;
+    }
+
+    template <class V>
+    COLOR_CONVERTER_SIMD_TARGET static int ReplaceLuminanceKernel(const uchar* src, const float* luminance, float luminanceScale, uchar* dst, int count, const float* decodeTable, const float* encodeTable)
+    {
+        int x = 0;
+
+        for (; x + V::width <= count; x += V::width)
+        {
+            typename V::F l, a, b;
+            BGR2LabVector<V>(src + 3 * x, decodeTable, l, a, b);
+            Lab2BGRVector<V>(V::mul(V::load(luminance + x), V::set(luminanceScale)), a, b, dst + 3 * x, encodeTable);
+        }
+
+        if (x < count)
+        {
+            uchar in[3 * V::width] = {}, out[3 * V::width];
+            float inL[V::width] = {};
+            std::memcpy(in, src + 3 * x, 3 * (count - x));
+            std::memcpy(inL, luminance + x, (count - x) * sizeof(float));
+
+            typename V::F l, a, b;
+            BGR2LabVector<V>(in, decodeTable, l, a, b);
+            Lab2BGRVector<V>(V::mul(V::load(inL), V::set(luminanceScale)), a, b, out, encodeTable);
+            std::memcpy(dst + 3 * x, out, 3 * (count - x));
+        }
+
+        return count;
+    }
+};
@@ -0,0 +1,760 @@
+#pragma once
+
+#include <opencv.hpp>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "ThreadPool.h"
+
+/// <summary>
+/// Separable Gaussian blur for single-channel float planes.
+///
+/// The 2D Gaussian is a product of two 1D Gaussians, so the blur is done as a
+/// horizontal pass followed by a vertical pass with a precomputed 1D kernel:
+/// O(k) taps per pixel instead of O(k^2).
+/// Image borders use the normalized-edge rule: taps outside the image are dropped
+/// and the sum is divided by the weight of the remaining taps. The valid region of
+/// a 2D kernel is a rectangle, so its weight factorizes into horizontal and vertical
+/// weights, and the two normalized passes give the same result as the 2D convolution.
+/// The only difference is float summation order, below 1e-5 for values in 0-1.
+///
+/// applyRecursive is a Young - van Vliet IIR approximation whose cost per pixel
+/// does not depend on sigma.
+///
+/// The pair variants blur two planes stored side by side in one CV_32F matrix
+/// (each row holds a row of the first plane followed by a row of the second),
+/// each plane with its own kernel. Both planes share every pass and every row
+/// walk, while each keeps contiguous loops and exactly the arithmetic of a
+/// single-plane blur.
+/// </summary>
+class GaussianBlur
+{
+public:
+
+    /// <summary>
+    /// Creates a normalized 1D Gaussian kernel
+    /// </summary>
+    /// <param name="size">Kernel size (odd)</param>
+    /// <param name="sigma">Standard deviation</param>
+    /// <returns>Kernel weights, center at size / 2</returns>
+    static std::vector<float> createKernel(int size, float sigma)
+    {
+        std::vector<float> kernel(size);
+        int center = size / 2;
+        float sum = 0.0f;
+
+        for (int i = 0; i < size; i++)
+        {
+            float d = (float)(i - center);
+            kernel[i] = exp(-(d * d) / (2 * sigma * sigma));
+            sum += kernel[i];
+        }
+
+        for (float& weight : kernel)
+            weight /= sum;
+
+        return kernel;
+    }
+
+    /// <summary>
+    /// Blurs a plane with a 1D kernel horizontally and then vertically
+    /// </summary>
+    /// <param name="input">Input plane (CV_32F)</param>
+    /// <param name="kernel">1D kernel from createKernel</param>
+    /// <param name="pool">Optional pool, each pass is split into row bands</param>
+    /// <returns>Blurred plane</returns>
+    /// <exception cref="std::invalid_argument">If input is not CV_32F</exception>
+    static cv::Mat apply(const cv::Mat& input, const std::vector<float>& kernel, ThreadPool* pool = nullptr)
+    {
+        if (input.type() != CV_32F)
+            throw std::invalid_argument("Gaussian blur expects a CV_32F plane");
+
+        const std::vector<float>* kernels[1] = { &kernel };
+        cv::Mat horizontal(input.size(), CV_32F), result(input.size(), CV_32F);
+
+        ThreadPool::run(pool, 0, input.rows, [&](int begin, int end) { horizontalPass<1>(input, horizontal, kernels, begin, end); });
+        ThreadPool::run(pool, 0, input.rows, [&](int begin, int end) { verticalPass<1>(horizontal, result, kernels, begin, end); });
+
+        return result;
+    }
+
+    /// <summary>
+    /// Blurs two side-by-side planes, each with its own 1D kernel
+    /// </summary>
+    /// <param name="input">Input planes (CV_32F, even width, left half is plane 0)</param>
+    /// <param name="kernel0">Kernel of plane 0, {1} leaves the plane unchanged</param>
+    /// <param name="kernel1">Kernel of plane 1, {1} leaves the plane unchanged</param>
+    /// <param name="pool">Optional pool, each pass is split into row bands</param>
+    /// <returns>Blurred planes in the same layout</returns>
+    /// <exception cref="std::invalid_argument">If input is not CV_32F or its width is odd</exception>
+    static cv::Mat applyPair(const cv::Mat& input, const std::vector<float>& kernel0, const std::vector<float>& kernel1, ThreadPool* pool = nullptr)
+    {
+        cv::Mat result, horizontal;
+        applyPair(input, result, horizontal, kernel0, kernel1, pool);
+        return result;
+    }
+
+    /// <summary>
+    /// Blurs two side-by-side planes into caller buffers. Buffers that
+    /// already have the input size and type are reused without allocation.
+    /// </summary>
+    /// <param name="input">Input planes (CV_32F, even width, left half is plane 0)</param>
+    /// <param name="output">Receives the blurred planes, may be the input itself</param>
+    /// <param name="scratch">Intermediate planes after the horizontal pass, must not share data with input or output</param>
+    /// <param name="kernel0">Kernel of plane 0, {1} leaves the plane unchanged</param>
+    /// <param name="kernel1">Kernel of plane 1, {1} leaves the plane unchanged</param>
+    /// <param name="pool">Optional pool, each pass is split into row bands</param>
+    /// <exception cref="std::invalid_argument">If input is not CV_32F or its width is odd</exception>
+    static void applyPair(const cv::Mat& input, cv::Mat& output, cv::Mat& scratch, const std::vector<float>& kernel0, const std::vector<float>& kernel1, ThreadPool* pool = nullptr)
+    {
+        if (input.type() != CV_32F || input.cols % 2 != 0)
+            throw std::invalid_argument("Gaussian pair blur expects two CV_32F planes side by side");
+
+        const std::vector<float>* kernels[2] = { &kernel0, &kernel1 };
+        scratch.create(input.size(), CV_32F);
+
+        // The horizontal pass reads all of the input before the vertical pass writes the output
+        ThreadPool::run(pool, 0, input.rows, [&](int begin, int end) { horizontalPass<2>(input, scratch, kernels, begin, end); });
+        output.create(input.size(), CV_32F);
+        ThreadPool::run(pool, 0, input.rows, [&](int begin, int end) { verticalPass<2>(scratch, output, kernels, begin, end); });
+    }
+
+    /// <summary>
+    /// Runs only the horizontal pass of apply, to measure the passes separately
+    /// </summary>
+    /// <param name="input">Input plane (CV_32F)</param>
+    /// <param name="output">Receives the pass result, must not share data with input</param>
+    /// <param name="kernel">1D kernel from createKernel</param>
+    /// <param name="pool">Optional pool, the pass is split into row bands</param>
+    /// <exception cref="std::invalid_argument">If input is not CV_32F</exception>
+    static void applyHorizontal(const cv::Mat& input, cv::Mat& output, const std::vector<float>& kernel, ThreadPool* pool = nullptr)
+    {
+        if (input.type() != CV_32F)
+            throw std::invalid_argument("Gaussian blur expects a CV_32F plane");
+
+        const std::vector<float>* kernels[1] = { &kernel };
+        output.create(input.size(), CV_32F);
+        ThreadPool::run(pool, 0, input.rows, [&](int begin, int end) { horizontalPass<1>(input, output, kernels, begin, end); });
+    }
+
+    /// <summary>
+    /// Runs only the vertical pass of apply, to measure the passes separately
+    /// </summary>
+    /// <param name="input">Input plane (CV_32F)</param>
+    /// <param name="output">Receives the pass result, must not share data with input</param>
+    /// <param name="kernel">1D kernel from createKernel</param>
+    /// <param name="pool">Optional pool, the pass is split into row bands</param>
+    /// <exception cref="std::invalid_argument">If input is not CV_32F</exception>
+    static void applyVertical(const cv::Mat& input, cv::Mat& output, const std::vector<float>& kernel, ThreadPool* pool = nullptr)
+    {
+        if (input.type() != CV_32F)
+            throw std::invalid_argument("Gaussian blur expects a CV_32F plane");
+
+        const std::vector<float>* kernels[1] = { &kernel };
+        output.create(input.size(), CV_32F);
+        ThreadPool::run(pool, 0, input.rows, [&](int begin, int end) { verticalPass<1>(input, output, kernels, begin, end); });
+    }
+
+    /// <summary>
+    /// Variance of a centered 1D kernel, used to match the recursive blur
+    /// to a truncated kernel of the exact path
+    /// </summary>
+    /// <param name="kernel">1D kernel</param>
+    /// <returns>Variance in pixels^2</returns>
+    static float kernelVariance(const std::vector<float>& kernel)
+    {
+        int center = (int)kernel.size() / 2;
+        float variance = 0.0f;
+
+        for (int i = 0; i < (int)kernel.size(); i++)
+            variance += kernel[i] * (float)((i - center) * (i - center));
+
+        return variance / kernelSum(kernel);
+    }
+
+    /// <summary>
+    /// Recursive (IIR) Gaussian blur after Young and van Vliet (1995).
+    ///
+    /// A third-order causal filter runs forward and then backward along each row
+    /// and each column, so every pixel costs a fixed number of operations for any sigma.
+    /// Borders replicate the edge value instead of using the normalized-edge rule,
+    /// so results near the image edge differ slightly from apply().
+    /// </summary>
+    /// <param name="input">Input plane (CV_32F)</param>
+    /// <param name="sigma">Standard deviation, clamped to at least 0.5</param>
+    /// <param name="pool">Optional pool, rows and then columns are split into bands</param>
+    /// <returns>Blurred plane</returns>
+    /// <exception cref="std::invalid_argument">If input is not CV_32F</exception>
+    static cv::Mat applyRecursive(const cv::Mat& input, float sigma, ThreadPool* pool = nullptr)
+    {
+        if (input.type() != CV_32F)
+            throw std::invalid_argument("Gaussian blur expects a CV_32F plane");
+
+        RecursiveCoefficients c = recursiveCoefficients(std::max(0.5f, sigma));
+        cv::Mat horizontal(input.size(), CV_32F), result(input.size(), CV_32F);
+
+        ThreadPool::run(pool, 0, input.rows, [&](int begin, int end) { recursiveHorizontalPass<1>(input, horizontal, &c, begin, end); });
+        ThreadPool::run(pool, 0, input.cols, [&](int begin, int end) { recursiveVerticalPass<1>(horizontal, result, &c, begin, end); });
+
+        return result;
+    }
+
+    /// <summary>
+    /// Recursive blur of two side-by-side planes, each with its own sigma
+    /// </summary>
+    /// <param name="input">Input planes (CV_32F, even width, left half is plane 0)</param>
+    /// <param name="sigma0">Standard deviation of plane 0, clamped to at least 0.5; 0 leaves the plane unchanged</param>
+    /// <param name="sigma1">Standard deviation of plane 1, clamped to at least 0.5; 0 leaves the plane unchanged</param>
+    /// <param name="pool">Optional pool, rows and then columns are split into bands</param>
+    /// <returns>Blurred planes in the same layout</returns>
+    /// <exception cref="std::invalid_argument">If input is not CV_32F or its width is odd</exception>
+    static cv::Mat applyRecursivePair(const cv::Mat& input, float sigma0, float sigma1, ThreadPool* pool = nullptr)
+    {
+        cv::Mat result, horizontal;
+        applyRecursivePair(input, result, horizontal, sigma0, sigma1, pool);
+        return result;
+    }
+
+    /// <summary>
+    /// Recursive blur of two side-by-side planes into caller buffers. Buffers
+    /// that already have the input size and type are reused without allocation.
+    /// </summary>
+    /// <param name="input">Input planes (CV_32F, even width, left half is plane 0)</param>
+    /// <param name="output">Receives the blurred planes, may be the input itself</param>
+    /// <param name="scratch">Intermediate planes after the horizontal pass, must not share data with input or output</param>
+    /// <param name="sigma0">Standard deviation of plane 0, clamped to at least 0.5; 0 leaves the plane unchanged</param>
+    /// <param name="sigma1">Standard deviation of plane 1, clamped to at least 0.5; 0 leaves the plane unchanged</param>
+    /// <param name="pool">Optional pool, rows and then columns are split into bands</param>
+    /// <exception cref="std::invalid_argument">If input is not CV_32F or its width is odd</exception>
+    static void applyRecursivePair(const cv::Mat& input, cv::Mat& output, cv::Mat& scratch, float sigma0, float sigma1, ThreadPool* pool = nullptr)
+    {
+        if (input.type() != CV_32F || input.cols % 2 != 0)
+            throw std::invalid_argument("Gaussian pair blur expects two CV_32F planes side by side");
+
+        // B = 1 without feedback passes the plane through unchanged
+        const RecursiveCoefficients identity = { 1.0f, 0.0f, 0.0f, 0.0f };
+        const RecursiveCoefficients c[2] = {
+            (sigma0 > 0.0f) ? recursiveCoefficients(std::max(0.5f, sigma0)) : identity,
+            (sigma1 > 0.0f) ? recursiveCoefficients(std::max(0.5f, sigma1)) : identity };
+        scratch.create(input.size(), CV_32F);
+
+        ThreadPool::run(pool, 0, input.rows, [&](int begin, int end) { recursiveHorizontalPass<2>(input, scratch, c, begin, end); });
+        output.create(input.size(), CV_32F);
+        ThreadPool::run(pool, 0, input.cols, [&](int begin, int end) { recursiveVerticalPass<2>(scratch, output, c, begin, end); });
+    }
+
+    /// <summary>
+    /// Gaussian approximated by three box blurs (Wells, 1986), each computed
+    /// with a running sum, so every pixel costs a fixed number of operations
+    /// for any sigma. The box widths are the odd widths whose combined
+    /// variance is closest to sigma^2 (see boxRadii). The result is a
+    /// piecewise quadratic bell with finite support rather than a Gaussian.
+    /// Near the image edge each box averages only the samples inside the
+    /// image, like the normalized-edge rule of apply().
+    /// </summary>
+    /// <param name="input">Input plane (CV_32F)</param>
+    /// <param name="sigma">Standard deviation; below about 0.6 the boxes are single taps and the plane is unchanged</param>
+    /// <param name="pool">Optional pool, rows and then columns are split into bands</param>
+    /// <returns>Blurred plane</returns>
+    /// <exception cref="std::invalid_argument">If input is not CV_32F</exception>
+    static cv::Mat applyBoxCascade(const cv::Mat& input, float sigma, ThreadPool* pool = nullptr)
+    {
+        if (input.type() != CV_32F)
+            throw std::invalid_argument("Gaussian blur expects a CV_32F plane");
+
+        int radii[3];
+        boxRadii(sigma, radii);
+
+        cv::Mat result(input.size(), CV_32F), scratch(input.size(), CV_32F);
+        ThreadPool::run(pool, 0, input.rows, [&](int begin, int end) { boxHorizontalPass<1>(input, result, scratch, radii, begin, end); });
+        ThreadPool::run(pool, 0, input.cols, [&](int begin, int end) { boxVerticalPass<1>(scratch, result, radii, begin, end); });
+
+        return result;
+    }
+
+    /// <summary>
+    /// Box cascade blur of two side-by-side planes into caller buffers, each
+    /// plane with its own sigma (see applyBoxCascade). Buffers that already
+    /// have the input size and type are reused without allocation.
+    /// </summary>
+    /// <param name="input">Input planes (CV_32F, even width, left half is plane 0)</param>
+    /// <param name="output">Receives the blurred planes, may be the input itself</param>
+    /// <param name="scratch">Intermediate planes, must not share data with input or output</param>
+    /// <param name="sigma0">Standard deviation of plane 0; 0 leaves the plane unchanged</param>
+    /// <param name="sigma1">Standard deviation of plane 1; 0 leaves the plane unchanged</param>
+    /// <param name="pool">Optional pool, rows and then columns are split into bands</param>
+    /// <exception cref="std::invalid_argument">If input is not CV_32F or its width is odd</exception>
+    static void applyBoxCascadePair(const cv::Mat& input, cv::Mat& output, cv::Mat& scratch, float sigma0, float sigma1, ThreadPool* pool = nullptr)
+    {
+        if (input.type() != CV_32F || input.cols % 2 != 0)
+            throw std::invalid_argument("Gaussian pair blur expects two CV_32F planes side by side");
+
+        int radii[2][3];
+        boxRadii(sigma0, radii[0]);
+        boxRadii(sigma1, radii[1]);
+
+        // The horizontal boxes of a row alternate between scratch and output, which may be the input:
+        // an input row is overwritten only after its first box has read it
+        scratch.create(input.size(), CV_32F);
+        output.create(input.size(), CV_32F);
+        ThreadPool::run(pool, 0, input.rows, [&](int begin, int end) { boxHorizontalPass<2>(input, output, scratch, &radii[0][0], begin, end); });
+        ThreadPool::run(pool, 0, input.cols, [&](int begin, int end) { boxVerticalPass<2>(scratch, output, &radii[0][0], begin, end); });
+    }
+
+    /// <summary>
+    /// Radii of the three boxes that approximate a Gaussian. Widths wl and
+    /// wl + 2 around the ideal width sqrt(4 sigma^2 + 1) are mixed so that
+    /// the variance sum (w^2 - 1) / 12 of the boxes is closest to sigma^2.
+    /// </summary>
+    /// <param name="sigma">Standard deviation</param>
+    /// <param name="radii">Receives the three box radii, (width - 1) / 2</param>
+    static void boxRadii(float sigma, int radii[3])
+    {
+        const int boxes = 3;
+        double variance = 12.0 * sigma * sigma;
+
+        int lower = (int)std::floor(std::sqrt(variance / boxes + 1.0));
+        if (lower % 2 == 0)
+            lower--;
+        lower = std::max(1, lower);
+
+        // Boxes of the lower width, the rest are two wider
+        int lowerCount = (int)std::lround((variance - boxes * lower * lower - 4.0 * boxes * lower - 3.0 * boxes) / (-4.0 * lower - 4.0));
+        lowerCount = std::max(0, std::min(boxes, lowerCount));
+
+        for (int i = 0; i < boxes; i++)
+            radii[i] = ((i < lowerCount ? lower : lower + 2) - 1) / 2;
+    }
+
+    /// <summary>
+    /// Distance over which the box cascade mixes values: the sum of the box radii
+    /// </summary>
+    /// <param name="sigma">Standard deviation</param>
+    /// <returns>Support radius in samples</returns>
+    static int boxCascadeSupport(float sigma)
+    {
+        int radii[3];
+        boxRadii(sigma, radii);
+        return radii[0] + radii[1] + radii[2];
+    }
+
+private:
+
+    /// <summary>
+    /// Normalized coefficients of the Young - van Vliet filter:
+    /// w[n] = B * x[n] + a1 * w[n-1] + a2 * w[n-2] + a3 * w[n-3]
+    /// </summary>
+    struct RecursiveCoefficients
+    {
+        float B, a1, a2, a3;
+    };
+
+    /// <summary>
+    /// Computes recursive filter coefficients for a given sigma
+    /// </summary>
+    /// <param name="sigma">Standard deviation (0.5 or more)</param>
+    /// <returns>Filter coefficients</returns>
+    static RecursiveCoefficients recursiveCoefficients(float sigma)
+    {
+        double q = (sigma >= 2.5f) ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * std::sqrt(1.0 - 0.26891 * sigma);
+        double q2 = q * q, q3 = q2 * q;
+
+        double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+        double b1 = 2.44413 * q + 2.85619 * q2 + 1.26661 * q3;
+        double b2 = -(1.4281 * q2 + 1.26661 * q3);
+        double b3 = 0.422205 * q3;
+
+        RecursiveCoefficients c;
+        c.a1 = (float)(b1 / b0);
+        c.a2 = (float)(b2 / b0);
+        c.a3 = (float)(b3 / b0);
+        c.B = (float)(1.0 - (b1 + b2 + b3) / b0);
+        return c;
+    }
+
+    /// <summary>
+    /// Forward and backward recursion along a band of rows
+    /// </summary>
+    /// <param name="src">Source planes</param>
+    /// <param name="dst">Destination planes of the same size</param>
+    /// <param name="c">Filter coefficients, one per plane</param>
+    /// <param name="rowBegin">First row</param>
+    /// <param name="rowEnd">Row after the last</param>
+    template <int Planes>
+    static void recursiveHorizontalPass(const cv::Mat& src, cv::Mat& dst, const RecursiveCoefficients* c, int rowBegin, int rowEnd)
+    {
+        const int width = src.cols / Planes;
+
+        for (int y = rowBegin; y < rowEnd; y++)
+            for (int plane = 0; plane < Planes; plane++)
+            {
+                const RecursiveCoefficients& k = c[plane];
+                const float* in = src.ptr<float>(y) + plane * width;
+                float* out = dst.ptr<float>(y) + plane * width;
+
+                float w1 = in[0], w2 = in[0], w3 = in[0];
+                for (int x = 0; x < width; x++)
+                {
+                    float w = k.B * in[x] + k.a1 * w1 + k.a2 * w2 + k.a3 * w3;
+                    out[x] = w;
+                    w3 = w2; w2 = w1; w1 = w;
+                }
+
+                w1 = w2 = w3 = out[width - 1];
+                for (int x = width - 1; x >= 0; x--)
+                {
+                    float w = k.B * out[x] + k.a1 * w1 + k.a2 * w2 + k.a3 * w3;
+                    out[x] = w;
+                    w3 = w2; w2 = w1; w1 = w;
+                }
+            }
+    }
+
+    /// <summary>
+    /// Forward and backward recursion along a band of columns. Rows are walked in order
+    /// and the filter state is kept per column, so memory is accessed row by row.
+    /// The band is processed in chunks whose state fits on the stack.
+    /// A band may cross from one plane into the next.
+    /// </summary>
+    /// <param name="src">Source planes</param>
+    /// <param name="dst">Destination planes of the same size</param>
+    /// <param name="c">Filter coefficients, one per plane</param>
+    /// <param name="colBegin">First column</param>
+    /// <param name="colEnd">Column after the last</param>
+    template <int Planes>
+    static void recursiveVerticalPass(const cv::Mat& src, cv::Mat& dst, const RecursiveCoefficients* c, int colBegin, int colEnd)
+    {
+        const int chunk = 256, height = src.rows, planeWidth = src.cols / Planes;
+        float w1[chunk], w2[chunk], w3[chunk];
+
+        for (int chunkBegin = colBegin; chunkBegin < colEnd; chunkBegin += chunk)
+        {
+            const int chunkEnd = std::min(colEnd, chunkBegin + chunk), width = chunkEnd - chunkBegin;
+
+            auto recurse = [&](const float* in, float* out)
+                {
+                    for (int plane = 0; plane < Planes; plane++)
+                    {
+                        const RecursiveCoefficients& k = c[plane];
+                        const int begin = std::max(chunkBegin, plane * planeWidth) - chunkBegin;
+                        const int end = std::min(chunkEnd, (plane + 1) * planeWidth) - chunkBegin;
+
+                        for (int x = begin; x < end; x++)
+                        {
+                            float w = k.B * in[x] + k.a1 * w1[x] + k.a2 * w2[x] + k.a3 * w3[x];
+                            out[x] = w;
+                            w3[x] = w2[x]; w2[x] = w1[x]; w1[x] = w;
+                        }
+                    }
+                };
+
+            const float* first = src.ptr<float>(0) + chunkBegin;
+            std::copy(first, first + width, w1);
+            std::copy(first, first + width, w2);
+            std::copy(first, first + width, w3);
+
+            for (int y = 0; y < height; y++)
+                recurse(src.ptr<float>(y) + chunkBegin, dst.ptr<float>(y) + chunkBegin);
+
+            const float* last = dst.ptr<float>(height - 1) + chunkBegin;
+            std::copy(last, last + width, w1);
+            std::copy(last, last + width, w2);
+            std::copy(last, last + width, w3);
+
+            for (int y = height - 1; y >= 0; y--)
+                recurse(dst.ptr<float>(y) + chunkBegin, dst.ptr<float>(y) + chunkBegin);
+        }
+    }
+
+    /// <summary>
+    /// Sum of the kernel weights in tap order, so interior pixels are divided
+    /// by exactly what the edge path would accumulate for a full window
+    /// </summary>
+    /// <param name="kernel">1D kernel</param>
+    /// <returns>Weight sum</returns>
+    static float kernelSum(const std::vector<float>& kernel)
+    {
+        float sum = 0.0f;
+        for (float weight : kernel)
+            sum += weight;
+        return sum;
+    }
+
+    /// <summary>
+    /// Horizontal pass over a band of rows. Border columns drop the taps
+    /// outside the row, interior columns run without bounds checks.
+    /// A plane whose kernel is the single tap {1} is copied.
+    /// </summary>
+    /// <param name="src">Source planes</param>
+    /// <param name="dst">Destination planes of the same size</param>
+    /// <param name="kernels">1D kernel of each plane</param>
+    /// <param name="rowBegin">First row</param>
+    /// <param name="rowEnd">Row after the last</param>
+    template <int Planes>
+    static void horizontalPass(const cv::Mat& src, cv::Mat& dst, const std::vector<float>* const* kernels, int rowBegin, int rowEnd)
+    {
+        const int width = src.cols / Planes;
+
+        for (int y = rowBegin; y < rowEnd; y++)
+            for (int plane = 0; plane < Planes; plane++)
+            {
+                const std::vector<float>& kernel = *kernels[plane];
+                const float* in = src.ptr<float>(y) + plane * width;
+                float* out = dst.ptr<float>(y) + plane * width;
+
+                if (isIdentity(kernel))
+                {
+                    std::copy(in, in + width, out);
+                    continue;
+                }
+
+                const int radius = (int)kernel.size() / 2;
+                const float* weights = kernel.data() + radius;
+                const float fullWeight = kernelSum(kernel);
+
+                // Columns [interiorBegin, interiorEnd) have the whole window inside the row
+                const int interiorBegin = std::min(radius, width), interiorEnd = std::max(interiorBegin, width - radius);
+
+                auto borderPixel = [&](int x)
+                    {
+                        int kBegin = std::max(-radius, -x), kEnd = std::min(radius, width - 1 - x);
+                        float sum = 0.0f, weightSum = 0.0f;
+
+                        for (int k = kBegin; k <= kEnd; k++)
+                        {
+                            sum += in[x + k] * weights[k];
+                            weightSum += weights[k];
+                        }
+                        out[x] = sum / weightSum;
+                    };
+
+                for (int x = 0; x < interiorBegin; x++)
+                    borderPixel(x);
+
+                for (int x = interiorBegin; x < interiorEnd; x++)
+                {
+                    float sum = 0.0f;
+                    for (int k = -radius; k <= radius; k++)
+                        sum += in[x + k] * weights[k];
+                    out[x] = sum / fullWeight;
+                }
+
+                for (int x = interiorEnd; x < width; x++)
+                    borderPixel(x);
+            }
+    }
+
+    /// <summary>
+    /// Vertical pass over a band of output rows, in column strips.
+    ///
+    /// Summing the taps of one output pixel walks down a column and touches
+    /// a different source row per tap, so on wide planes every tap misses the
+    /// cache. Instead each strip of columns is finished for all rows of the
+    /// band before the next: an output row accumulates source row segments
+    /// tap by tap, and consecutive output rows slide a window of kernel-height
+    /// segments (1 KB each, about 100 KB for 101 taps) that stays in L2.
+    /// The taps are summed in the same order as per pixel.
+    /// </summary>
+    /// <param name="src">Source planes</param>
+    /// <param name="dst">Destination planes of the same size</param>
+    /// <param name="kernels">1D kernel of each plane</param>
+    /// <param name="rowBegin">First row</param>
+    /// <param name="rowEnd">Row after the last</param>
+    template <int Planes>
+    static void verticalPass(const cv::Mat& src, cv::Mat& dst, const std::vector<float>* const* kernels, int rowBegin, int rowEnd)
+    {
+        const int strip = 256, height = src.rows, width = src.cols / Planes;
+        const size_t stride = src.step1();
+        float sum[strip];
+
+        for (int plane = 0; plane < Planes; plane++)
+        {
+            const std::vector<float>& kernel = *kernels[plane];
+
+            if (isIdentity(kernel))
+            {
+                for (int y = rowBegin; y < rowEnd; y++)
+                    std::copy(src.ptr<float>(y) + plane * width, src.ptr<float>(y) + (plane + 1) * width, dst.ptr<float>(y) + plane * width);
+                continue;
+            }
+
+            const int radius = (int)kernel.size() / 2;
+            const float* weights = kernel.data() + radius;
+            const float fullWeight = kernelSum(kernel);
+
+            for (int stripBegin = 0; stripBegin < width; stripBegin += strip)
+            {
+                const int stripWidth = std::min(strip, width - stripBegin);
+
+                for (int y = rowBegin; y < rowEnd; y++)
+                {
+                    // The tap range and weight sum depend only on the row
+                    int kBegin = std::max(-radius, -y), kEnd = std::min(radius, height - 1 - y);
+                    float weightSum = fullWeight;
+
+                    if (kBegin != -radius || kEnd != radius)
+                    {
+                        weightSum = 0.0f;
+                        for (int k = kBegin; k <= kEnd; k++)
+                            weightSum += weights[k];
+                    }
+
+                    // Source column x of the row at tap k is center[k * stride + x]
+                    const float* center = src.ptr<float>(y) + plane * width + stripBegin;
+                    std::fill(sum, sum + stripWidth, 0.0f);
+
+                    for (int k = kBegin; k <= kEnd; k++)
+                    {
+                        const float* in = center + k * (ptrdiff_t)stride;
+                        const float weight = weights[k];
+
+                        // A constant trip count lets the compiler vectorize full strips
+                        if (stripWidth == strip)
+                            for (int x = 0; x < strip; x++)
+                                sum[x] += in[x] * weight;
+                        else
+                            for (int x = 0; x < stripWidth; x++)
+                                sum[x] += in[x] * weight;
+                    }
+
+                    float* out = dst.ptr<float>(y) + plane * width + stripBegin;
+                    for (int x = 0; x < stripWidth; x++)
+                        out[x] = sum[x] / weightSum;
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Averages a line over a window of radius r with a running sum. Near the
+    /// ends only the samples inside the line are averaged. The sum is kept in
+    /// double, so adding and removing samples does not drift over long lines.
+    /// </summary>
+    /// <param name="in">First input sample</param>
+    /// <param name="out">First output sample, must not overlap the input</param>
+    /// <param name="length">Number of samples</param>
+    /// <param name="step">Distance between samples in floats</param>
+    /// <param name="radius">Window radius</param>
+    static void boxLine(const float* in, float* out, int length, ptrdiff_t step, int radius)
+    {
+        const int fullCount = 2 * radius + 1;
+        const double fullScale = 1.0 / fullCount;
+        double sum = 0.0;
+
+        for (int i = 0; i <= std::min(radius, length - 1); i++)
+            sum += in[i * step];
+
+        for (int i = 0; i < length; i++)
+        {
+            int count = std::min(length - 1, i + radius) - std::max(0, i - radius) + 1;
+            out[i * step] = (float)(sum * (count == fullCount ? fullScale : 1.0 / count));
+
+            if (i + radius + 1 < length)
+                sum += in[(i + radius + 1) * step];
+            if (i - radius >= 0)
+                sum -= in[(i - radius) * step];
+        }
+    }
+
+    /// <summary>
+    /// Three horizontal boxes over a band of rows: src -> scratch -> dst -> scratch.
+    /// Each row depends only on itself, so dst may be src.
+    /// </summary>
+    /// <param name="src">Source planes</param>
+    /// <param name="dst">Planes of the same size used between the boxes</param>
+    /// <param name="scratch">Receives the result</param>
+    /// <param name="radii">Three box radii per plane, planes one after another</param>
+    /// <param name="rowBegin">First row</param>
+    /// <param name="rowEnd">Row after the last</param>
+    template <int Planes>
+    static void boxHorizontalPass(const cv::Mat& src, cv::Mat& dst, cv::Mat& scratch, const int* radii, int rowBegin, int rowEnd)
+    {
+        const int width = src.cols / Planes;
+
+        for (int y = rowBegin; y < rowEnd; y++)
+            for (int plane = 0; plane < Planes; plane++)
+            {
+                const int* r = radii + 3 * plane;
+                float* middle = scratch.ptr<float>(y) + plane * width;
+                float* other = dst.ptr<float>(y) + plane * width;
+
+                boxLine(src.ptr<float>(y) + plane * width, middle, width, 1, r[0]);
+                boxLine(middle, other, width, 1, r[1]);
+                boxLine(other, middle, width, 1, r[2]);
+            }
+    }
+
+    /// <summary>
+    /// Three vertical boxes over a band of columns: src -> dst -> src -> dst.
+    /// Like recursiveVerticalPass, rows are walked in order with a running sum
+    /// per column of a chunk, so memory is accessed row by row.
+    /// </summary>
+    /// <param name="src">Source planes, overwritten</param>
+    /// <param name="dst">Receives the result</param>
+    /// <param name="radii">Three box radii per plane, planes one after another</param>
+    /// <param name="colBegin">First column</param>
+    /// <param name="colEnd">Column after the last</param>
+    template <int Planes>
+    static void boxVerticalPass(cv::Mat& src, cv::Mat& dst, const int* radii, int colBegin, int colEnd)
+    {
+        const int chunk = 256, height = src.rows, planeWidth = src.cols / Planes;
+        double sum[chunk];
+
+        auto box = [&](const float* in, size_t inStride, float* out, size_t outStride, int width, int radius)
+            {
+                std::fill(sum, sum + width, 0.0);
+                for (int y = 0; y <= std::min(radius, height - 1); y++)
+                    for (int x = 0; x < width; x++)
+                        sum[x] += in[y * inStride + x];
+
+                for (int y = 0; y < height; y++)
+                {
+                    const double scale = 1.0 / (std::min(height - 1, y + radius) - std::max(0, y - radius) + 1);
+                    float* row = out + y * outStride;
+                    for (int x = 0; x < width; x++)
+                        row[x] = (float)(sum[x] * scale);
+
+                    if (y + radius + 1 < height)
+                    {
+                        const float* added = in + (y + radius + 1) * inStride;
+                        for (int x = 0; x < width; x++)
+                            sum[x] += added[x];
+                    }
+                    if (y - radius >= 0)
+                    {
+                        const float* removed = in + (y - radius) * inStride;
+                        for (int x = 0; x < width; x++)
+                            sum[x] -= removed[x];
+                    }
+                }
+            };
+
+        // A band may cross from one plane into the next, each chunk stays within one plane
+        for (int plane = 0; plane < Planes; plane++)
+        {
+            const int* r = radii + 3 * plane;
+            const int begin = std::max(colBegin, plane * planeWidth), end = std::min(colEnd, (plane + 1) * planeWidth);
+
+            for (int chunkBegin = begin; chunkBegin < end; chunkBegin += chunk)
+            {
+                const int width = std::min(chunk, end - chunkBegin);
+                float* first = src.ptr<float>(0) + chunkBegin;
+                float* second = dst.ptr<float>(0) + chunkBegin;
+
+                box(first, src.step1(), second, dst.step1(), width, r[0]);
+                box(second, dst.step1(), first, src.step1(), width, r[1]);
+                box(first, src.step1(), second, dst.step1(), width, r[2]);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Checks for the single-tap kernel {1} that leaves a plane unchanged
+    /// </summary>
+    /// <param name="kernel">1D kernel</param>
+    /// <returns>True for {1}</returns>
+    static bool isIdentity(const std::vector<float>& kernel)
+    {
+        return kernel.size() == 1 && kernel[0] == 1.0f;
+    }
+};
@@ -2,17 +2,151 @@
 
 #include <opencv.hpp>
 #include <vector>
+#include <type_traits>
 
 /// <summary>
 /// The class for working with Lab Image channels
 ///
 /// Provides methods for separating and combining Lab image channels. 
 /// L - brightness, a - green-red, b - blue-yellow.
+///
+/// Stages that can read strided data use channel views over the interleaved
+/// image, and stages that want planes use PlanarLab, which ColorConverter::BGR2LabPlanes
+/// fills directly. splitLab and mergeLab copy and are only needed for separate Mats.
 /// </summary>
 class LabImageProcessor 
 {
 public:
 
+    /// <summary>
+    /// One channel of an interleaved image, addressed in place without a copy.
+    /// Elements of a row are pixelStride() values apart.
+    /// </summary>
+    template <typename T>
+    class ChannelView
+    {
+        typedef typename std::conditional<std::is_const<T>::value, const uchar, uchar>::type Byte;
+
+        Byte* data;
+        size_t rowStep;
+        int pixelChannels, viewRows, viewCols;
+
+    public:
+
+        /// <summary>
+        /// Creates a view over raw image memory, see LabImageProcessor::channelView
+        /// </summary>
+        /// <param name="data">First element of the channel in the first row</param>
+        /// <param name="rowStep">Bytes between rows</param>
+        /// <param name="pixelChannels">Values per pixel</param>
+        /// <param name="rows">Rows</param>
+        /// <param name="cols">Columns</param>
+        ChannelView(Byte* data, size_t rowStep, int pixelChannels, int rows, int cols)
+            : data(data), rowStep(rowStep), pixelChannels(pixelChannels), viewRows(rows), viewCols(cols)
+        {
+        }
+
+        int rows() const { return viewRows; }
+        int cols() const { return viewCols; }
+        int pixelStride() const { return pixelChannels; }
+
+        /// <summary>
+        /// First element of a row, the next ones follow every pixelStride() values
+        /// </summary>
+        /// <param name="y">Row</param>
+        /// <returns>Pointer into the image</returns>
+        T* row(int y) const { return reinterpret_cast<T*>(data + y * rowStep); }
+
+        T& operator()(int y, int x) const { return row(y)[x * pixelChannels]; }
+    };
+
+    /// <summary>
+    /// Lab image stored as three planes (structure of arrays) in one
+    /// allocation. Each plane is a continuous CV_32F matrix.
+    /// </summary>
+    struct PlanarLab
+    {
+        /// <summary>L, a and b planes one below another</summary>
+        cv::Mat planes;
+
+        /// <summary>Views of the L, a and b planes, usable wherever split channels are expected</summary>
+        std::vector<cv::Mat> channels;
+
+        PlanarLab() = default;
+
+        explicit PlanarLab(cv::Size size)
+        {
+            create(size);
+        }
+
+        /// <summary>
+        /// Allocates the planes, keeping the buffer when the size is unchanged
+        /// </summary>
+        /// <param name="size">Image size</param>
+        void create(cv::Size size)
+        {
+            if (!planes.empty() && this->size() == size)
+                return;
+
+            planes.create(3 * size.height, size.width, CV_32F);
+            channels = { planes.rowRange(0, size.height), planes.rowRange(size.height, 2 * size.height), planes.rowRange(2 * size.height, 3 * size.height) };
+        }
+
+        cv::Size size() const { return channels.empty() ? cv::Size() : channels[0].size(); }
+    };
+
+    /// <summary>
+    /// Views one channel of a Lab image in place
+    /// </summary>
+    /// <param name="labImage">Lab Image (CV_32FC3)</param>
+    /// <param name="channel">0 for L, 1 for a, 2 for b</param>
+    /// <returns>Writable view into labImage</returns>
+    /// <exception cref="std::invalid_argument">If the image is not CV_32FC3 or the channel is out of range</exception>
+    static ChannelView<float> channelView(cv::Mat& labImage, int channel)
+    {
+        checkChannel(labImage, channel);
+        return ChannelView<float>(labImage.data + channel * sizeof(float), labImage.step, 3, labImage.rows, labImage.cols);
+    }
+
+    /// <summary>
+    /// Views one channel of a Lab image in place
+    /// </summary>
+    /// <param name="labImage">Lab Image (CV_32FC3)</param>
+    /// <param name="channel">0 for L, 1 for a, 2 for b</param>
+    /// <returns>Read-only view into labImage</returns>
+    /// <exception cref="std::invalid_argument">If the image is not CV_32FC3 or the channel is out of range</exception>
+    static ChannelView<const float> channelView(const cv::Mat& labImage, int channel)
+    {
+        checkChannel(labImage, channel);
+        return ChannelView<const float>(labImage.data + channel * sizeof(float), labImage.step, 3, labImage.rows, labImage.cols);
+    }
+
+    /// <summary>
+    /// Converts a Lab image into planes
+    /// </summary>
+    /// <param name="labImage">Input Lab Image (CV_32FC3)</param>
+    /// <returns>Planar copy</returns>
+    /// <exception cref="std::invalid_argument">If the image is not CV_32FC3</exception>
+    static PlanarLab toPlanar(const cv::Mat& labImage)
+    {
+        if (labImage.type() != CV_32FC3)
+            throw std::invalid_argument("Lab image must be CV_32FC3");
+
+        PlanarLab planar(labImage.size());
+        splitLab(labImage, planar.channels, 0, labImage.rows);
+        return planar;
+    }
+
+    /// <summary>
+    /// Converts planes back into an interleaved Lab image
+    /// </summary>
+    /// <param name="planar">Planar Lab image</param>
+    /// <returns>Lab Image (CV_32FC3)</returns>
+    static cv::Mat fromPlanar(const PlanarLab& planar)
+    {
+        return mergeLab(planar.channels);
+    }
+
     /// <summary>
     /// Splits the Lab image into separate channels    
     /// </summary>
@@ -29,17 +163,34 @@ public:
         channels[1] = cv::Mat(labImage.size(), CV_32F);
         channels[2] = cv::Mat(labImage.size(), CV_32F); 
 
-        for (int y = 0; y < labImage.rows; y++)
+        splitLab(labImage, channels, 0, labImage.rows);
+
+        return channels;
+    }
+
+    /// <summary>
+    /// Splits a band of rows of the Lab image into allocated channels
+    /// </summary>
+    /// <param name="labImage">Input Lab Image (CV_32FC3)</param>
+    /// <param name="channels">Three allocated CV_32F matrices of the same size</param>
+    /// <param name="rowBegin">First row</param>
+    /// <param name="rowEnd">Row after the last</param>
+    static void splitLab(const cv::Mat& labImage, std::vector<cv::Mat>& channels, int rowBegin, int rowEnd)
+    {
+        for (int y = rowBegin; y < rowEnd; y++)
+        {
+            const float* src = labImage.ptr<float>(y);
+            float* l = channels[0].ptr<float>(y);
+            float* a = channels[1].ptr<float>(y);
+            float* b = channels[2].ptr<float>(y);
+
             for (int x = 0; x < labImage.cols; x++) 
             {
-                cv::Vec3f labPixel = labImage.at<cv::Vec3f>(y, x);
-
-                channels[0].at<float>(y, x) = labPixel[0];
-                channels[1].at<float>(y, x) = labPixel[1];
-                channels[2].at<float>(y, x) = labPixel[2];
+                l[x] = src[3 * x];
+                a[x] = src[3 * x + 1];
+                b[x] = src[3 * x + 2];
             }
-
-        return channels;
+        }
     }
 
     /// <summary>
@@ -55,16 +206,49 @@ public:
 
         cv::Mat labImage(channels[0].size(), CV_32FC3);
 
-        for (int y = 0; y < labImage.rows; y++)
-            for (int x = 0; x < labImage.cols; x++) {
-                cv::Vec3f labPixel;
-                labPixel[0] = channels[0].at<float>(y, x);
-                labPixel[1] = channels[1].at<float>(y, x); 
-                labPixel[2] = channels[2].at<float>(y, x);
+        mergeLab(channels, labImage, 0, labImage.rows);
+
+        return labImage;
+    }
+
+    /// <summary>
+    /// Combines a band of rows of individual channels into an allocated Lab image
+    /// </summary>
+    /// <param name="channels">A vector of three matrices: L, a, b channels</param>
+    /// <param name="labImage">Allocated Lab Image of the same size (CV_32FC3)</param>
+    /// <param name="rowBegin">First row</param>
+    /// <param name="rowEnd">Row after the last</param>
+    static void mergeLab(const std::vector<cv::Mat>& channels, cv::Mat& labImage, int rowBegin, int rowEnd)
+    {
+        for (int y = rowBegin; y < rowEnd; y++)
+        {
+            const float* l = channels[0].ptr<float>(y);
+            const float* a = channels[1].ptr<float>(y);
+            const float* b = channels[2].ptr<float>(y);
+            float* dst = labImage.ptr<float>(y);
 
-                labImage.at<cv::Vec3f>(y, x) = labPixel;
+            for (int x = 0; x < labImage.cols; x++) 
+            {
+                dst[3 * x] = l[x];
+                dst[3 * x + 1] = a[x];
+                dst[3 * x + 2] = b[x];
             }
+        }
+    }
 
-        return labImage;
+private:
+
+    /// <summary>
+    /// Validates the arguments of channelView
+    /// </summary>
+    /// <param name="labImage">Lab Image</param>
+    /// <param name="channel">Channel index</param>
+    /// <exception cref="std::invalid_argument">If the image is not CV_32FC3 or the channel is out of range</exception>
+    static void checkChannel(const cv::Mat& labImage, int channel)
+    {
+        if (labImage.type() != CV_32FC3)
+            throw std::invalid_argument("Lab image must be CV_32FC3");
+        if (channel < 0 || channel > 2)
+            throw std::invalid_argument("Lab channel must be 0, 1 or 2");
     }
 };
\ No newline at end of file
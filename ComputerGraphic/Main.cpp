@@ -1,20 +1,79 @@
 #include <iostream>
 #include <string>
 #include <exception>
+#include <filesystem>
 #include "TestRunner.h"
+#include "BenchmarkRunner.h"
+#include "BatchProcessor.h"
 
 using namespace std;
 
-int main()
+int main(int argc, char* argv[])
 {
+    // Batch mode: Main --batch <input directory> <output directory>
+    if (argc == 4 && string(argv[1]) == "--batch")
+    {
+        BatchProcessor batch(ShadowHighlightsFilter(0.3f, 0.2f, 0.5f, 15.0f));
+        BatchProcessor::Report report;
+
+        try
+        {
+            report = batch.run(string(argv[2]), string(argv[3]));
+        }
+        catch (const filesystem::filesystem_error& error)
+        {
+            cerr << "Batch failed: " << error.what() << endl;
+            return 2;
+        }
+
+        // Non-zero when any image failed, so scheduled jobs can detect it
+        BatchProcessor::printReport(report);
+        return report.failures.empty() ? 0 : 1;
+    }
+
+    // Kernel benchmarks, blur mode comparisons and the sweep: Main --benchmark
+    if (argc == 2 && string(argv[1]) == "--benchmark")
+    {
+        BenchmarkRunner::runKernelSuite();
+        BenchmarkRunner::runBlurCrossover();
+        BenchmarkRunner::runBoxCascadeError();
+        BenchmarkRunner::runSweepBenchmark();
+        return 0;
+    }
+
+    // Headless regression against golden images: Main --regression <source image> <golden directory> [--update | --record-timings]
+    if ((argc == 4 || argc == 5) && string(argv[1]) == "--regression")
+    {
+        TestRunner::RegressionMode mode = TestRunner::RegressionMode::Check;
+        if (argc == 5 && string(argv[4]) == "--update")
+            mode = TestRunner::RegressionMode::UpdateGolden;
+        else if (argc == 5 && string(argv[4]) == "--record-timings")
+            mode = TestRunner::RegressionMode::RecordTimings;
+        else if (argc == 5)
+        {
+            cerr << "Unknown option " << argv[4] << endl;
+            return 2;
+        }
+
+        cv::Mat source = cv::imread(argv[2]);
+        if (source.empty())
+        {
+            cerr << "Cannot load " << argv[2] << endl;
+            return 2;
+        }
+
+        return TestRunner::runRegressionTest(source, string(argv[3]), mode);
+    }
+
     //setlocale(LC_ALL, "RUSSIAN");
     string imagePath = "Image\\original.jpg";
     cv::Mat image = cv::imread(imagePath);
 
     if (image.empty())
-        throw exception("   ");
-
-
+    {
+        cerr << "   " << endl;
+        return 1;
+    }
 
     // 1. Comprehensive testing
     TestRunner::runComprehensiveTest(image);
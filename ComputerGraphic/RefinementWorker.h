@@ -0,0 +1,133 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cstdint>
+
+/// <summary>
+/// Background thread that only runs the latest posted task.
+///
+/// Every post or cancel starts a new generation. A pending task of an older
+/// generation is dropped without running, and a running one sees
+/// isCurrent(generation) turn false and is expected to stop at its next check.
+/// </summary>
+class RefinementWorker
+{
+    /// <summary>
+    /// State shared with the thread, so the thread can outlive the worker
+    /// when the worker is destroyed by its own task
+    /// </summary>
+    struct State
+    {
+        std::mutex stateMutex;
+        std::condition_variable taskReady;
+
+        /// <summary>Task waiting to run and the generation it was posted with</summary>
+        std::function<void(uint64_t)> pending;
+        uint64_t pendingGeneration = 0;
+
+        /// <summary>Latest generation, tasks of older ones are outdated</summary>
+        std::atomic<uint64_t> generation{ 0 };
+        bool stopping = false;
+    };
+
+    std::shared_ptr<State> state;
+
+    /// <summary>Declared last, so it starts after the state it uses is constructed</summary>
+    std::thread thread;
+
+public:
+
+    RefinementWorker()
+        : state(std::make_shared<State>()),
+          thread([shared = state]() { workerLoop(*shared); })
+    {
+    }
+
+    /// <summary>
+    /// Cancels the running task and waits for it to return. Called from the
+    /// task itself (a callback that drops the last owner), it detaches
+    /// instead, and the thread exits once the task returns.
+    /// </summary>
+    ~RefinementWorker()
+    {
+        {
+            std::lock_guard<std::mutex> lock(state->stateMutex);
+            state->stopping = true;
+            state->pending = nullptr;
+            state->generation++;
+        }
+        state->taskReady.notify_one();
+
+        if (thread.get_id() == std::this_thread::get_id())
+            thread.detach();
+        else
+            thread.join();
+    }
+
+    RefinementWorker(const RefinementWorker&) = delete;
+    RefinementWorker& operator=(const RefinementWorker&) = delete;
+
+    /// <summary>
+    /// Replaces the pending task and makes the running one outdated
+    /// </summary>
+    /// <param name="task">Task taking its generation</param>
+    void post(std::function<void(uint64_t)> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(state->stateMutex);
+            state->pending = std::move(task);
+            state->pendingGeneration = ++state->generation;
+        }
+        state->taskReady.notify_one();
+    }
+
+    /// <summary>
+    /// Drops the pending task and makes the running one outdated
+    /// </summary>
+    void cancel()
+    {
+        std::lock_guard<std::mutex> lock(state->stateMutex);
+        state->pending = nullptr;
+        state->generation++;
+    }
+
+    /// <summary>
+    /// Checks whether a task is still the latest one
+    /// </summary>
+    /// <param name="taskGeneration">Generation the task was posted with</param>
+    /// <returns>False once a newer task was posted or the task was cancelled</returns>
+    bool isCurrent(uint64_t taskGeneration) const
+    {
+        return state->generation.load() == taskGeneration;
+    }
+
+private:
+
+    static void workerLoop(State& state)
+    {
+        for (;;)
+        {
+            std::function<void(uint64_t)> task;
+            uint64_t taskGeneration;
+
+            {
+                std::unique_lock<std::mutex> lock(state.stateMutex);
+                state.taskReady.wait(lock, [&state]() { return state.stopping || state.pending; });
+
+                if (state.stopping)
+                    return;
+
+                task = std::move(state.pending);
+                state.pending = nullptr;
+                taskGeneration = state.pendingGeneration;
+            }
+
+            task(taskGeneration);
+        }
+    }
+};
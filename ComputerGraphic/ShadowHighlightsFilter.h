@@ -4,7 +4,18 @@
 #include <vector>
 #include "ColorConverter.h"
 #include "LabImageProcessor.h"
+#include "GaussianBlur.h"
+#include "ThreadPool.h"
+#include "RefinementWorker.h"
+#include "StageStats.h"
+#include "Workspace.h"
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <limits>
+#include <chrono>
+#include <cstring>
+#include <map>
 
 /// <summary>
 /// A filter for correcting shadows and highlights of an image.
@@ -15,370 +26,1703 @@
 /// </summary>
 class ShadowHighlightsFilter
 {
+public:
+
+    /// <summary>
+    /// Mask blur algorithm
+    /// </summary>
+    enum class BlurMode
+    {
+        /// <summary>Separable convolution with truncated kernels, cost grows with radius</summary>
+        Exact,
+
+        /// <summary>Recursive Gaussian of matching variance, cost independent of radius</summary>
+        Recursive,
+
+        /// <summary>Three box blurs by running sums of matching variance, cost independent of radius, approximate shape</summary>
+        BoxCascade
+    };
+
+    /// <summary>
+    /// Correction settings of one combination in a sweep
+    /// </summary>
+    struct Params
+    {
+        /// <summary>Shadow lightening power (0.0 - 1.0)</summary>
+        float shadowAmount = 0.3f;
+
+        /// <summary>Highlight darkening power (0.0 - 1.0)</summary>
+        float highlightAmount = 0.3f;
+
+        /// <summary>Tonal width (0.0 - 1.0)</summary>
+        float tonalWidth = 0.5f;
+
+        /// <summary>Blur radius for masks (0.0 - 50.0)</summary>
+        float blurRadius = 15.0f;
+    };
+
+private:
+
 	/// <summary>Shadow lightening power (0.0 - 1.0)</summary>
 	float shadowAmount;
 
     /// <summary>Highlight darkening power (0.0 - 1.0)</summary>
 	float highlightAmount;
 
-    /// <summary>Tonal  width (0.0 - 1.0)</summary>
-    float tonalWidth;
+    /// <summary>Tonal  width (0.0 - 1.0)</summary>
+    float tonalWidth;
+
+    /// <summary>The radius of blurring masks (0.0 - 50.0)</summary>
+    float blurRadius;
+
+    /// <summary>Mask blur algorithm</summary>
+    BlurMode blurMode;
+
+    /// <summary>Workers for row-band parallel stages, null when single-threaded</summary>
+    std::shared_ptr<ThreadPool> threadPool;
+
+    /// <summary>Limit for the float working planes in bytes, 0 for no limit</summary>
+    size_t memoryBudget;
+
+    /// <summary>Allowed error of the masks from a reduced resolution, 0 for full resolution</summary>
+    float maskErrorBudget;
+
+    /// <summary>
+    /// Owner of the refinement thread of one filter. Copies start without
+    /// one, so a preview or setter on one copy never cancels the refinement
+    /// of another; assigning over a filter cancels its own refinement.
+    /// </summary>
+    struct RefinementSlot
+    {
+        std::unique_ptr<RefinementWorker> worker;
+
+        RefinementSlot() = default;
+        RefinementSlot(const RefinementSlot&) {}
+        RefinementSlot(RefinementSlot&&) = default;
+        RefinementSlot& operator=(RefinementSlot&&) = default;
+
+        RefinementSlot& operator=(const RefinementSlot&)
+        {
+            if (worker)
+                worker->cancel();
+            return *this;
+        }
+    };
+
+    /// <summary>Background thread refining previews, created by the first preview of this filter</summary>
+    RefinementSlot refinement;
+
+    /// <summary>On the copy that runs a refinement: its worker and generation, checked between stages</summary>
+    const RefinementWorker* refiningOn;
+    uint64_t refiningGeneration;
+
+    /// <summary>Measured preview cost per proxy pixel in nanoseconds</summary>
+    double previewNanosPerPixel;
+
+    /// <summary>Input of the last preview and its downscaled proxy</summary>
+    cv::Mat previewSource, previewProxy;
+
+    /// <summary>Thrown inside a refinement that became outdated</summary>
+    struct RefinementCancelled {};
+
+    /// <summary>
+    /// Planes of the last apply and what they were computed from. Stored
+    /// planes are never written again, so filter copies share the cache.
+    /// </summary>
+    struct StageCache
+    {
+        std::mutex mutex;
+
+        /// <summary>Input the planes belong to: content hash, size and type</summary>
+        uint64_t sourceHash = 0;
+        cv::Size sourceSize;
+        int sourceType = -1;
+
+        /// <summary>Normalized luminance of the input</summary>
+        cv::Mat luminance;
+
+        /// <summary>Blurred masks side by side, their maxima and the settings they were built with</summary>
+        cv::Mat masks;
+        double shadowMax = 1.0, highlightMax = 1.0;
+        float tonalWidth = 0.0f, blurRadius = 0.0f, maskErrorBudget = 0.0f;
+        BlurMode blurMode = BlurMode::Exact;
+    };
+
+    /// <summary>Whether apply keeps its intermediate planes for the next call</summary>
+    bool cacheEnabled;
+
+    /// <summary>Stage caches of apply and of previews, shared by copies</summary>
+    std::shared_ptr<StageCache> stageCache, previewCache;
+
+    /// <summary>Receiver of the stage measurements of every apply, empty when not instrumented</summary>
+    std::function<void(const StageStats&)> statsSink;
+
+    /// <summary>Stats being collected by the running apply, null otherwise</summary>
+    StageStats* stageStats;
+
+    /// <summary>Planes reused between calls, null to allocate them per call; shared by copies</summary>
+    std::shared_ptr<Workspace> workspace;
+
+    /// <summary>Estimated float working planes alive at once per pixel: luminance and two double-width mask buffers during the blur</summary>
+    static const size_t workingBytesPerPixel = 5 * sizeof(float);
+
+public:
+
+    /// <summary>
+    /// Creates a filter with specified parameters
+    /// </summary>
+    /// <param name="shadows">Shadow lightening power (0.0 - 1.0)</param>
+    /// <param name="highlights">Highlight darkening power (0.0 - 1.0)</param>
+    /// <param name="width">Tonal width (0.0 - 1.0)</param>
+    /// <param name="radius">Blur radius for masks (0.0 - 50.0)</param>
+    ShadowHighlightsFilter(float shadows = 0.3f, float highlights = 0.3f, float width = 0.5f, float radius = 15.0f)
+        :   shadowAmount(std::max(0.0f, std::min(1.0f, shadows))), 
+            highlightAmount(std::max(0.0f, std::min(1.0f, highlights))), 
+            tonalWidth(std::max(0.0f, std::min(1.0f, width))), 
+            blurRadius(std::max(0.0f, std::min(50.0f, radius))),
+            blurMode(BlurMode::Exact),
+            memoryBudget(0),
+            maskErrorBudget(0.0f),
+            refiningOn(nullptr),
+            refiningGeneration(0),
+            previewNanosPerPixel(500.0),
+            cacheEnabled(true),
+            stageCache(std::make_shared<StageCache>()),
+            previewCache(std::make_shared<StageCache>()),
+            stageStats(nullptr)
+    {
+    }
+
+    /// <summary>
+    /// Applies the filter to an image.
+    ///
+    /// Luminance and the blurred masks with their maxima are kept for the next
+    /// call (see setCacheEnabled). Each stage is recomputed only when its
+    /// inputs changed: luminance when the image content does, the masks also
+    /// when the tonal width, blur radius, blur mode or mask error budget
+    /// does. A change of the amounts alone costs one correction pass and the
+    /// conversion back. With a stats sink (see setStatsSink) every call is
+    /// measured as by the overload taking StageStats.
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <returns>Processed image</returns>
+    /// <exception cref="std::invalid_argument">If input image is empty</exception>
+    cv::Mat apply(const cv::Mat& inputImage) 
+    {
+        cv::Mat result;
+        apply(inputImage, result);
+        return result;
+    }
+
+    /// <summary>
+    /// Applies the filter into a caller's image. Its buffer is kept when it
+    /// already has the input size and type CV_8UC3, also for a view into a
+    /// larger buffer; otherwise it is reallocated as by cv::Mat::create.
+    /// The output may be the input itself: rows are converted pixel by pixel
+    /// in place. An output that overlaps the input in any other way, or an
+    /// in-place call over the memory budget (tiles read past their borders),
+    /// is computed in a working plane and copied.
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="outputImage">Receives the processed image</param>
+    /// <exception cref="std::invalid_argument">If input image is empty</exception>
+    void apply(const cv::Mat& inputImage, cv::Mat& outputImage) 
+    {
+        if (!statsSink)
+            return applyStages(inputImage, outputImage);
+
+        StageStats stats;
+        apply(inputImage, outputImage, stats);
+        statsSink(stats);
+    }
+
+    /// <summary>
+    /// Applies the filter and measures every stage that runs: wall time,
+    /// bytes of the planes it allocates and pixels it processes.
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="stats">Receives the stages in the order they ran</param>
+    /// <returns>Processed image</returns>
+    /// <exception cref="std::invalid_argument">If input image is empty</exception>
+    cv::Mat apply(const cv::Mat& inputImage, StageStats& stats) 
+    {
+        cv::Mat result;
+        apply(inputImage, result, stats);
+        return result;
+    }
+
+    /// <summary>
+    /// Applies the filter into a caller's image (see apply without stats)
+    /// and measures every stage that runs
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="outputImage">Receives the processed image</param>
+    /// <param name="stats">Receives the stages in the order they ran</param>
+    /// <exception cref="std::invalid_argument">If input image is empty</exception>
+    void apply(const cv::Mat& inputImage, cv::Mat& outputImage, StageStats& stats) 
+    {
+        stats = StageStats();
+        stageStats = &stats;
+
+        try
+        {
+            applyStages(inputImage, outputImage);
+            stageStats = nullptr;
+        }
+        catch (...)
+        {
+            stageStats = nullptr;
+            throw;
+        }
+    }
+
+    /// <summary>
+    /// Applies many combinations of settings to one image.
+    ///
+    /// Luminance is computed once and the masks once per distinct pair of
+    /// tonal width and blur radius, since the amounts do not enter them.
+    /// Groups of combinations sharing masks are taken in batches: the masks
+    /// of a batch are built with the threads of this filter, then its
+    /// corrections and conversions back run in parallel across the
+    /// combinations, and the masks are released before the next batch. A
+    /// batch closes once it has a combination per thread or when one more
+    /// group of masks (8 bytes per pixel) would exceed the memory budget; a
+    /// batch with fewer combinations than threads runs them one after
+    /// another with the threads of this filter. The blur mode and mask error
+    /// budget of this filter are used for all of them. Images over the
+    /// memory budget are processed one combination at a time in tiles,
+    /// without sharing.
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="combinations">Settings to apply, clamped like the setters</param>
+    /// <returns>Processed images in the order of the combinations</returns>
+    /// <exception cref="std::invalid_argument">If input image is empty</exception>
+    std::vector<cv::Mat> applySweep(const cv::Mat& inputImage, const std::vector<Params>& combinations)
+    {
+        if (inputImage.empty())
+            throw std::invalid_argument("Input image is empty");
+
+        std::vector<cv::Mat> results(combinations.size());
+
+        if (needsTiles(inputImage))
+        {
+            for (size_t i = 0; i < combinations.size(); i++)
+            {
+                results[i] = newPlane(inputImage.rows, inputImage.cols, CV_8UC3);
+                withParams(combinations[i]).applyTiled(inputImage, results[i]);
+            }
+
+            if (workspace)
+                workspace->endCall();
+            return results;
+        }
+
+        uint64_t sourceHash = cacheEnabled ? imageHash(inputImage) : 0;
+        cv::Mat luminance, cachedMasks;
+        double cachedShadowMax, cachedHighlightMax;
+        lookupCache(inputImage, sourceHash, luminance, cachedMasks, cachedShadowMax, cachedHighlightMax);
+
+        if (luminance.empty())
+        {
+            luminance = convertToLuminance(inputImage);
+            storeCache(inputImage, sourceHash, luminance, cv::Mat(), 1.0, 1.0);
+        }
+
+        // Combinations that share masks, keyed by clamped tonal width and blur radius
+        std::map<std::pair<float, float>, std::vector<size_t>> groups;
+        for (size_t i = 0; i < combinations.size(); i++)
+        {
+            ShadowHighlightsFilter combination = withParams(combinations[i]);
+            groups[std::make_pair(combination.tonalWidth, combination.blurRadius)].push_back(i);
+        }
+
+        // Groups whose masks fit next to the luminance and the blur scratch plane; needsTiles guarantees one
+        const size_t fittingGroups = (memoryBudget == 0) ? groups.size() : std::max<size_t>(1, (memoryBudget / luminance.total() - 3 * sizeof(float)) / (2 * sizeof(float)));
+        const size_t threads = threadPool ? (size_t)threadPool->size() : 1;
+
+        // Masks of the groups in a batch, each combination of the batch points at the masks of its group
+        struct GroupMasks
+        {
+            cv::Mat masks;
+            double shadowMax, highlightMax;
+        };
+        std::vector<GroupMasks> groupMasks;
+        std::vector<size_t> batch, groupOf(combinations.size());
+
+        for (auto group = groups.begin(); group != groups.end();)
+        {
+            groupMasks.clear();
+            batch.clear();
+
+            while (group != groups.end() && groupMasks.size() < fittingGroups && batch.size() < threads)
+            {
+                GroupMasks built;
+                built.masks = withParams(combinations[group->second.front()]).createNormalizableMasks(luminance, built.shadowMax, built.highlightMax);
+
+                for (size_t index : group->second)
+                {
+                    groupOf[index] = groupMasks.size();
+                    batch.push_back(index);
+                }
+                groupMasks.push_back(built);
+                ++group;
+            }
+
+            // One combination per band with single-threaded filters, unless there are too few combinations to fill the pool
+            bool acrossCombinations = threadPool && batch.size() >= threads;
+
+            auto correct = [&](int begin, int end)
+                {
+                    for (int b = begin; b < end; b++)
+                    {
+                        size_t i = batch[b];
+                        const GroupMasks& masks = groupMasks[groupOf[i]];
+                        ShadowHighlightsFilter combination = withParams(combinations[i]);
+                        if (acrossCombinations)
+                            combination.threadPool.reset();
+
+                        results[i] = newPlane(inputImage.rows, inputImage.cols, CV_8UC3);
+                        combination.applyMasks(inputImage, luminance, masks.masks, masks.shadowMax, masks.highlightMax, results[i]);
+                    }
+                };
+
+            if (acrossCombinations)
+                ThreadPool::run(threadPool.get(), 0, (int)batch.size(), correct);
+            else
+                correct(0, (int)batch.size());
+        }
+
+        if (workspace)
+            workspace->endCall();
+
+        return results;
+    }
+
+    /// <summary>
+    /// Fast result for interactive use, refined in the background.
+    ///
+    /// The current settings are applied to a downscaled proxy whose size is
+    /// chosen from the measured cost of earlier previews to fit the latency
+    /// target, with the blur radius scaled along. The proxy of the last input
+    /// is kept, so only the first preview of an image pays for the downscale;
+    /// an image changed in place must be passed as a new matrix. The full
+    /// resolution result is then computed on a background thread with a
+    /// snapshot of the settings. A later preview or a parameter change makes
+    /// it outdated: it stops at the next stage and is never delivered.
+    /// </summary>
+    /// <param name="inputImage">Input BGR image, shared with the refinement and not to be written until it is delivered</param>
+    /// <param name="onRefined">Called on the background thread with the full resolution result (empty if it failed), or nullptr for no refinement</param>
+    /// <param name="latencyMs">Time target for the proxy result in milliseconds</param>
+    /// <returns>Processed proxy image, at most the size of the input</returns>
+    /// <exception cref="std::invalid_argument">If input image is empty</exception>
+    cv::Mat preview(const cv::Mat& inputImage, const std::function<void(const cv::Mat&)>& onRefined, double latencyMs = 16.0)
+    {
+        if (inputImage.empty())
+            throw std::invalid_argument("Input image is empty");
+
+        cancelRefinement();
+
+        cv::Mat proxy = previewProxyOf(inputImage, latencyMs);
+        auto start = std::chrono::steady_clock::now();
+
+        // Single-threaded, so it never waits behind the refinement on the pool
+        ShadowHighlightsFilter proxyFilter(*this);
+        proxyFilter.threadPool.reset();
+        proxyFilter.memoryBudget = 0;
+        proxyFilter.blurRadius = blurRadius * proxy.cols / inputImage.cols;
+        proxyFilter.stageCache = previewCache;
+
+        cv::Mat result = proxyFilter.apply(proxy);
+
+        double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        // Averaged, because a smaller proxy also has a smaller blur radius and is cheaper per pixel
+        previewNanosPerPixel = std::max(1.0, 0.5 * previewNanosPerPixel + 0.5 * elapsed / proxy.total());
+
+        if (onRefined)
+        {
+            if (!refinement.worker)
+                refinement.worker = std::make_unique<RefinementWorker>();
+
+            ShadowHighlightsFilter snapshot(*this);
+            snapshot.previewSource = cv::Mat();
+            snapshot.previewProxy = cv::Mat();
+            snapshot.refiningOn = refinement.worker.get();
+
+            refinement.worker->post([snapshot, inputImage, onRefined](uint64_t generation) mutable
+                {
+                    snapshot.refiningGeneration = generation;
+                    cv::Mat refined;
+
+                    try
+                    {
+                        refined = snapshot.apply(inputImage);
+                    }
+                    catch (const RefinementCancelled&)
+                    {
+                        return;
+                    }
+                    catch (const std::exception&)
+                    {
+                    }
+
+                    if (snapshot.refiningOn->isCurrent(generation))
+                        onRefined(refined);
+                });
+        }
+
+        return result;
+    }
+
+    /// <summary>
+    /// Makes a running or pending preview refinement outdated
+    /// </summary>
+    void cancelRefinement()
+    {
+        if (refinement.worker)
+            refinement.worker->cancel();
+    }
+
+    /// <summary>
+    /// Sets the shadow lightening power
+    /// </summary>
+    /// <param name="amount">Value from 0.0 to 1.0</param>
+    void setShadowAmount(float amount) 
+    { 
+        shadowAmount = std::max(0.0f, std::min(1.0f, amount)); 
+        cancelRefinement();
+    }
+
+    /// <summary>
+    /// Sets the highlight darkening power
+    /// </summary>
+    /// <param name="amount">Value from 0.0 to 1.0</param>
+    void setHighlightAmount(float amount) 
+    { 
+        highlightAmount = std::max(0.0f, std::min(1.0f, amount)); 
+        cancelRefinement();
+    }
+
+    /// <summary>
+    /// Sets the tonal width
+    /// </summary>
+    /// <param name="width">Value from 0.0 to 1.0</param>
+    void setTonalWidth(float width) 
+    { 
+        tonalWidth = std::max(0.0f, std::min(1.0f, width)); 
+        cancelRefinement();
+    }
+
+    /// <summary>
+    /// Sets the blur radius for masks
+    /// </summary>
+    /// <param name="radius">Value from 0.0 to 50.0</param>
+    void setBlurRadius(float radius) 
+    { 
+        blurRadius = std::max(0.0f, std::min(50.0f, radius)); 
+        cancelRefinement();
+    }
+
+    /// <summary>
+    /// Sets the mask blur algorithm
+    /// </summary>
+    /// <param name="mode">Exact convolution, recursive Gaussian or box cascade</param>
+    void setBlurMode(BlurMode mode) 
+    { 
+        blurMode = mode; 
+        cancelRefinement();
+    }
+
+    /// <summary>
+    /// Sets the number of threads used by every stage.
+    /// Each stage is split into row bands, the output does not depend on the count.
+    /// </summary>
+    /// <param name="threads">1 for single-threaded, 0 for all hardware threads</param>
+    void setThreadCount(int threads) 
+    { 
+        if (threads == 1)
+            threadPool.reset();
+        else
+            threadPool = std::make_shared<ThreadPool>(threads);
+    }
+
+    /// <summary>
+    /// Limits the memory of the float working planes. Images that would need
+    /// more are processed in overlapping tiles with the same result.
+    /// The input and output images are not counted.
+    /// </summary>
+    /// <param name="bytes">Budget in bytes, 0 to always process the whole image at once</param>
+    void setMemoryBudget(size_t bytes) 
+    { 
+        memoryBudget = bytes; 
+    }
+
+    /// <summary>
+    /// Lets the masks be built on a 2x, 4x or 8x reduced grid and upsampled
+    /// bilinearly. The masks are low-frequency after the blur, so the factor
+    /// is picked from the blur radius as the largest one whose estimated
+    /// error stays within the budget; large radii then cost about as much
+    /// as small ones.
+    /// </summary>
+    /// <param name="error">Allowed mask error (0.0 - 0.1, in mask units), 0 to always use full resolution</param>
+    void setMaskErrorBudget(float error) 
+    { 
+        maskErrorBudget = std::max(0.0f, std::min(0.1f, error)); 
+        cancelRefinement();
+    }
+
+    /// <summary>
+    /// Enables keeping the intermediate planes of apply between calls, about
+    /// 12 bytes per pixel. Tiled processing never keeps them.
+    /// </summary>
+    /// <param name="enabled">False to recompute every stage and release the kept planes</param>
+    void setCacheEnabled(bool enabled) 
+    { 
+        cacheEnabled = enabled; 
+
+        if (!enabled)
+        {
+            stageCache = std::make_shared<StageCache>();
+            previewCache = std::make_shared<StageCache>();
+        }
+    }
+
+    /// <summary>
+    /// Takes the working planes and blur kernels from a workspace that keeps
+    /// them between calls. Repeated calls on images of one size then make no
+    /// heap allocations, including the returned image once the caller has
+    /// released the previous one. The workspace may be shared by filters
+    /// and threads.
+    /// </summary>
+    /// <param name="planes">Workspace, null to allocate per call</param>
+    void setWorkspace(std::shared_ptr<Workspace> planes) 
+    { 
+        workspace = std::move(planes); 
+    }
+
+    /// <summary>
+    /// Sends the stage measurements of every apply to a sink, on the thread
+    /// that ran apply (a preview refinement runs on its background thread).
+    /// Without a sink each stage only checks a null pointer.
+    /// </summary>
+    /// <param name="sink">Receiver of the measurements, empty to stop measuring</param>
+    void setStatsSink(std::function<void(const StageStats&)> sink) 
+    { 
+        statsSink = std::move(sink); 
+    }
+
+    /// <summary>
+    /// Prints current filter settings
+    /// </summary>
+    void printCurrentSettings() const 
+    {
+        std::cout << "Current Shadow/Highlights parameters:\nShadow Amount: " << shadowAmount * 100 << "%\nHighlight Amount: " << highlightAmount * 100 << "%\nTonal Width: " << tonalWidth << "\nBlur Radius: " << blurRadius << " px";
+    }
+private:
+
+    /// <summary>
+    /// Runs a loop body over row bands, on the thread pool if there is one
+    /// </summary>
+    /// <param name="rows">Number of rows</param>
+    /// <param name="body">Body taking [rowBegin, rowEnd)</param>
+    template <typename Body>
+    void forEachRowBand(int rows, const Body& body) const
+    {
+        ThreadPool::run(threadPool.get(), 0, rows, body);
+    }
+
+    /// <summary>
+    /// Plane for a stage, from the workspace if there is one
+    /// </summary>
+    /// <param name="rows">Rows</param>
+    /// <param name="cols">Columns</param>
+    /// <param name="type">OpenCV type</param>
+    /// <returns>Plane with undefined content</returns>
+    cv::Mat newPlane(int rows, int cols, int type) const
+    {
+        return workspace ? workspace->acquire(rows, cols, type) : cv::Mat(rows, cols, type);
+    }
+
+    /// <summary>
+    /// Plane for a stage that counts it as allocated only when the workspace
+    /// had no free plane to reuse
+    /// </summary>
+    /// <param name="rows">Rows</param>
+    /// <param name="cols">Columns</param>
+    /// <param name="type">OpenCV type</param>
+    /// <param name="timer">Timer of the stage</param>
+    /// <returns>Plane with undefined content</returns>
+    cv::Mat newPlane(int rows, int cols, int type, StageTimer& timer) const
+    {
+        bool allocated = true;
+        cv::Mat plane = workspace ? workspace->acquire(rows, cols, type, allocated) : cv::Mat(rows, cols, type);
+        if (allocated)
+            timer.addAllocation(plane.total() * plane.elemSize());
+        return plane;
+    }
+
+    /// <summary>
+    /// Stops a refinement that a newer preview or a parameter change made outdated
+    /// </summary>
+    /// <exception cref="RefinementCancelled">If this copy runs an outdated refinement</exception>
+    void throwIfOutdated() const
+    {
+        if (refiningOn && !refiningOn->isCurrent(refiningGeneration))
+            throw RefinementCancelled();
+    }
+
+    /// <summary>
+    /// Whether the working planes of an image exceed the memory budget
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <returns>True if the image is processed in tiles</returns>
+    bool needsTiles(const cv::Mat& inputImage) const
+    {
+        return memoryBudget > 0 && inputImage.total() * workingBytesPerPixel > memoryBudget;
+    }
+
+    /// <summary>
+    /// Checks whether the pixels of two images share any bytes
+    /// </summary>
+    /// <param name="first">First image</param>
+    /// <param name="second">Second image</param>
+    /// <returns>True if their memory ranges overlap</returns>
+    static bool overlaps(const cv::Mat& first, const cv::Mat& second)
+    {
+        if (first.empty() || second.empty())
+            return false;
+
+        const uchar* firstEnd = first.ptr<uchar>(first.rows - 1) + first.cols * first.elemSize();
+        const uchar* secondEnd = second.ptr<uchar>(second.rows - 1) + second.cols * second.elemSize();
+        return first.data < secondEnd && second.data < firstEnd;
+    }
+
+    /// <summary>
+    /// Runs the stages of apply, reusing the cached ones, into the output
+    /// buffer when it can be written directly, and lets the workspace
+    /// release the planes this call did not need
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="outputImage">Receives the processed image</param>
+    /// <exception cref="std::invalid_argument">If input image is empty</exception>
+    void applyStages(const cv::Mat& inputImage, cv::Mat& outputImage)
+    {
+        if (inputImage.empty())
+            throw std::invalid_argument("Input image is empty");
+
+        bool reusable = outputImage.size() == inputImage.size() && outputImage.type() == CV_8UC3;
+        bool inPlace = outputImage.data == inputImage.data && outputImage.step == inputImage.step;
+        bool direct = reusable && (!overlaps(inputImage, outputImage) || (inPlace && !needsTiles(inputImage)));
+
+        // The output is assigned only at the end, since it may be the input matrix itself
+        cv::Mat result = outputImage;
+        if (!direct)
+        {
+            StageTimer timer(stageStats, "output plane", inputImage.total(), 0);
+            result = newPlane(inputImage.rows, inputImage.cols, CV_8UC3, timer);
+        }
+
+        runStages(inputImage, result);
+
+        if (workspace)
+            workspace->endCall();
+
+        if (direct)
+            return;
+
+        if (reusable)
+        {
+            StageTimer timer(stageStats, "copy to output", inputImage.total(), 0);
+            result.copyTo(outputImage);
+        }
+        else
+            outputImage = result;
+    }
+
+    /// <summary>
+    /// Stages of apply between the workspace calls of applyStages
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="result">Allocated output of the input size (CV_8UC3), may be the input</param>
+    void runStages(const cv::Mat& inputImage, cv::Mat& result)
+    {
+        if (needsTiles(inputImage))
+            return applyTiled(inputImage, result);
+
+        uint64_t sourceHash = cacheEnabled ? imageHash(inputImage) : 0;
+        cv::Mat luminanceFloat, masks;
+        double shadowMax = 1.0, highlightMax = 1.0;
+        lookupCache(inputImage, sourceHash, luminanceFloat, masks, shadowMax, highlightMax);
+
+        if (luminanceFloat.empty())
+        {
+            luminanceFloat = convertToLuminance(inputImage);
+            throwIfOutdated();
+            storeCache(inputImage, sourceHash, luminanceFloat, cv::Mat(), 1.0, 1.0);
+        }
+
+        if (masks.empty())
+        {
+            masks = createNormalizableMasks(luminanceFloat, shadowMax, highlightMax);
+            storeCache(inputImage, sourceHash, luminanceFloat, masks, shadowMax, highlightMax);
+        }
+
+        applyMasks(inputImage, luminanceFloat, masks, shadowMax, highlightMax, result);
+    }
+
+    /// <summary>
+    /// Copy of this filter with the settings of one sweep combination
+    /// </summary>
+    /// <param name="params">Combination settings</param>
+    /// <returns>Configured filter sharing the thread pool and caches</returns>
+    ShadowHighlightsFilter withParams(const Params& params) const
+    {
+        ShadowHighlightsFilter filter(*this);
+        filter.shadowAmount = std::max(0.0f, std::min(1.0f, params.shadowAmount));
+        filter.highlightAmount = std::max(0.0f, std::min(1.0f, params.highlightAmount));
+        filter.tonalWidth = std::max(0.0f, std::min(1.0f, params.tonalWidth));
+        filter.blurRadius = std::max(0.0f, std::min(50.0f, params.blurRadius));
+        return filter;
+    }
+
+    /// <summary>
+    /// Creates the blurred masks of the whole frame and finds the maxima they
+    /// are normalized by. The masks are already built here, so one parallel
+    /// reduction over them is cheaper than the serial luminance proof of
+    /// hasSaturatedBlock, which only pays off in applyTiled.
+    /// </summary>
+    /// <param name="luminance">Normalized luminance of the whole image</param>
+    /// <param name="shadowMax">Maximum of the shadow mask</param>
+    /// <param name="highlightMax">Maximum of the highlight mask</param>
+    /// <returns>Blurred masks side by side</returns>
+    cv::Mat createNormalizableMasks(const cv::Mat& luminance, double& shadowMax, double& highlightMax) const
+    {
+        cv::Mat masks = createMasks(luminance);
+        throwIfOutdated();
+
+        cv::Rect frame(0, 0, luminance.cols, luminance.rows);
+        maskMaxima(maskPlane(masks, 0, frame), maskPlane(masks, 1, frame), shadowMax, highlightMax);
+
+        return masks;
+    }
+
+    /// <summary>
+    /// Corrects luminance with the masks and converts back to BGR
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="luminance">Normalized luminance</param>
+    /// <param name="masks">Blurred masks side by side</param>
+    /// <param name="shadowMax">Maximum of the shadow mask</param>
+    /// <param name="highlightMax">Maximum of the highlight mask</param>
+    /// <param name="result">Allocated output of the input size (CV_8UC3), may be the input</param>
+    void applyMasks(const cv::Mat& inputImage, const cv::Mat& luminance, const cv::Mat& masks, double shadowMax, double highlightMax, cv::Mat& result) const
+    {
+        cv::Rect frame(0, 0, luminance.cols, luminance.rows);
+        cv::Mat correctedLuminance = applyAdvancedCorrection(luminance, maskPlane(masks, 0, frame), maskPlane(masks, 1, frame), shadowMax, highlightMax);
+        throwIfOutdated();
+
+        convertBackToBGR(inputImage, correctedLuminance, result);
+    }
+
+    /// <summary>
+    /// Content hash of an image. Rows are hashed in parallel and combined in
+    /// order, so the hash does not depend on the thread count.
+    /// </summary>
+    /// <param name="image">Image of any type</param>
+    /// <returns>64-bit hash</returns>
+    uint64_t imageHash(const cv::Mat& image) const
+    {
+        StageTimer timer(stageStats, "hash", image.total(), 0);
+        const size_t rowBytes = image.cols * image.elemSize();
+
+        // One 64-bit hash per row, stored as two ints since OpenCV has no 64-bit integer type
+        cv::Mat rowHashes = newPlane(image.rows, 1, CV_32SC2, timer);
+
+        forEachRowBand(image.rows, [&](int rowBegin, int rowEnd)
+            {
+                for (int y = rowBegin; y < rowEnd; y++)
+                {
+                    const uchar* row = image.ptr<uchar>(y);
+                    uint64_t hash = 0x9E3779B97F4A7C15ull;
+                    size_t i = 0;
+
+                    for (; i + 8 <= rowBytes; i += 8)
+                    {
+                        uint64_t word;
+                        std::memcpy(&word, row + i, 8);
+                        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+                        hash ^= hash >> 32;
+                    }
+                    for (; i < rowBytes; i++)
+                        hash = (hash ^ row[i]) * 0x100000001B3ull;
+
+                    *rowHashes.ptr<uint64_t>(y) = hash;
+                }
+            });
+
+        uint64_t hash = ((uint64_t)image.rows << 40) ^ ((uint64_t)image.cols << 16) ^ (uint64_t)image.type();
+        for (int y = 0; y < image.rows; y++)
+            hash = (hash ^ *rowHashes.ptr<uint64_t>(y)) * 0x100000001B3ull;
+
+        return hash;
+    }
+
+    /// <summary>
+    /// Takes the cached planes that are still valid for the input and the current settings
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="sourceHash">Content hash of the input</param>
+    /// <param name="luminance">Cached luminance, left empty if stale</param>
+    /// <param name="masks">Cached blurred masks, left empty if stale</param>
+    /// <param name="shadowMax">Maximum of the cached shadow mask</param>
+    /// <param name="highlightMax">Maximum of the cached highlight mask</param>
+    void lookupCache(const cv::Mat& inputImage, uint64_t sourceHash, cv::Mat& luminance, cv::Mat& masks, double& shadowMax, double& highlightMax) const
+    {
+        if (!cacheEnabled)
+            return;
+
+        StageCache& cache = *stageCache;
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        if (cache.sourceHash != sourceHash || cache.sourceSize != inputImage.size() || cache.sourceType != inputImage.type())
+            return;
+
+        luminance = cache.luminance;
+
+        if (!cache.masks.empty() && cache.tonalWidth == tonalWidth && cache.blurRadius == blurRadius && cache.blurMode == blurMode && cache.maskErrorBudget == maskErrorBudget)
+        {
+            masks = cache.masks;
+            shadowMax = cache.shadowMax;
+            highlightMax = cache.highlightMax;
+        }
+    }
+
+    /// <summary>
+    /// Keeps the planes of the input for the next call
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="sourceHash">Content hash of the input</param>
+    /// <param name="luminance">Normalized luminance</param>
+    /// <param name="masks">Blurred masks built with the current settings, or empty</param>
+    /// <param name="shadowMax">Maximum of the shadow mask</param>
+    /// <param name="highlightMax">Maximum of the highlight mask</param>
+    void storeCache(const cv::Mat& inputImage, uint64_t sourceHash, const cv::Mat& luminance, const cv::Mat& masks, double shadowMax, double highlightMax)
+    {
+        if (!cacheEnabled)
+            return;
+
+        StageCache& cache = *stageCache;
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        cache.sourceHash = sourceHash;
+        cache.sourceSize = inputImage.size();
+        cache.sourceType = inputImage.type();
+        cache.luminance = luminance;
+        cache.masks = masks;
+        cache.shadowMax = shadowMax;
+        cache.highlightMax = highlightMax;
+        cache.tonalWidth = tonalWidth;
+        cache.blurRadius = blurRadius;
+        cache.blurMode = blurMode;
+        cache.maskErrorBudget = maskErrorBudget;
+    }
+
+    /// <summary>
+    /// Downscales the input to the number of pixels a preview can process
+    /// within the latency target, reusing the proxy of the previous input
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="latencyMs">Time target in milliseconds</param>
+    /// <returns>Proxy image, the input itself if it is small enough</returns>
+    cv::Mat previewProxyOf(const cv::Mat& inputImage, double latencyMs)
+    {
+        double targetPixels = latencyMs * 1e6 / previewNanosPerPixel;
+        double factor = std::min(1.0, std::sqrt(targetPixels / inputImage.total()));
+        cv::Size proxySize(std::max(1, (int)std::lround(inputImage.cols * factor)), std::max(1, (int)std::lround(inputImage.rows * factor)));
+
+        if (proxySize == inputImage.size())
+            return inputImage;
 
-    /// <summary>The radius of blurring masks (0.0 - 50.0)</summary>
-    float blurRadius;
+        // The cost estimate drifts a little between calls, keep the proxy unless the size is off by more than 10%
+        bool sameSource = previewSource.data == inputImage.data && previewSource.size() == inputImage.size();
+        bool closeSize = !previewProxy.empty() && std::abs(previewProxy.cols - proxySize.width) * 10 <= proxySize.width;
 
-public:
+        if (!sameSource || !closeSize)
+        {
+            cv::resize(inputImage, previewProxy, proxySize, 0, 0, cv::INTER_AREA);
+            previewSource = inputImage;
+        }
+
+        return previewProxy;
+    }
 
     /// <summary>
-    /// Creates a filter with specified parameters
+    /// Processes the image in tiles that fit the memory budget.
+    ///
+    /// Each tile is extended by a halo as wide as the mask blur support, so
+    /// the masks of the tile core see the same pixels as in a full-frame run.
+    /// The mask maxima are global and must be known before the first tile is
+    /// written. A luminance-only pre-pass looks for a block that proves a
+    /// maximum of 1 (see hasSaturatedBlock) and stops at the first proof for
+    /// both masks; only a mask without a proof gets an exact pass over the
+    /// tiles that builds it and keeps the maximum. The last pass then builds,
+    /// normalizes and applies the masks tile by tile.
     /// </summary>
-    /// <param name="shadows">Shadow lightening power (0.0 - 1.0)</param>
-    /// <param name="highlights">Highlight darkening power (0.0 - 1.0)</param>
-    /// <param name="width">Tonal width (0.0 - 1.0)</param>
-    /// <param name="radius">Blur radius for masks (0.0 - 50.0)</param>
-    ShadowHighlightsFilter(float shadows = 0.3f, float highlights = 0.3f, float width = 0.5f, float radius = 15.0f)
-        :   shadowAmount(std::max(0.0f, std::min(1.0f, shadows))), 
-            highlightAmount(std::max(0.0f, std::min(1.0f, highlights))), 
-            tonalWidth(std::max(0.0f, std::min(1.0f, width))), 
-            blurRadius(std::max(0.0f, std::min(50.0f, radius)))
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="result">Allocated output of the input size (CV_8UC3), not overlapping the input</param>
+    /// <exception cref="std::invalid_argument">If the budget cannot hold a tile with its halo</exception>
+    void applyTiled(const cv::Mat& inputImage, cv::Mat& result) const
     {
+        int halo = maskHalo();
+        std::vector<cv::Rect> tiles = splitIntoTiles(inputImage.size(), halo, maskAlignment());
+        cv::Rect imageRect(0, 0, inputImage.cols, inputImage.rows);
+
+        bool shadowProven = false, highlightProven = false;
+
+        for (size_t i = 0; i < tiles.size() && !(shadowProven && highlightProven); i++)
+        {
+            cv::Rect window = cv::Rect(tiles[i].x - halo, tiles[i].y - halo, tiles[i].width + 2 * halo, tiles[i].height + 2 * halo) & imageRect;
+            cv::Rect core(tiles[i].x - window.x, tiles[i].y - window.y, tiles[i].width, tiles[i].height);
+
+            throwIfOutdated();
+            cv::Mat luminance = convertToLuminance(inputImage(window));
+            shadowProven = shadowProven || shadowMaxIsOne(luminance, core);
+            highlightProven = highlightProven || highlightMaxIsOne(luminance, core);
+        }
+
+        double shadowMax = shadowProven ? 1.0 : -std::numeric_limits<double>::infinity();
+        double highlightMax = highlightProven ? 1.0 : -std::numeric_limits<double>::infinity();
+
+        if (!shadowProven || !highlightProven)
+            for (const cv::Rect& tile : tiles)
+            {
+                cv::Rect window = cv::Rect(tile.x - halo, tile.y - halo, tile.width + 2 * halo, tile.height + 2 * halo) & imageRect;
+                cv::Rect core(tile.x - window.x, tile.y - window.y, tile.width, tile.height);
+
+                throwIfOutdated();
+                double shadowFound, highlightFound;
+                cv::Mat masks = createMasks(convertToLuminance(inputImage(window)));
+                maskMaxima(maskPlane(masks, 0, core), maskPlane(masks, 1, core), shadowFound, highlightFound);
+
+                if (!shadowProven)
+                    shadowMax = std::max(shadowMax, shadowFound);
+                if (!highlightProven)
+                    highlightMax = std::max(highlightMax, highlightFound);
+            }
+
+        for (const cv::Rect& tile : tiles)
+        {
+            cv::Rect window = cv::Rect(tile.x - halo, tile.y - halo, tile.width + 2 * halo, tile.height + 2 * halo) & imageRect;
+            cv::Rect core(tile.x - window.x, tile.y - window.y, tile.width, tile.height);
+
+            throwIfOutdated();
+            cv::Mat luminance = convertToLuminance(inputImage(window));
+            cv::Mat masks = createMasks(luminance);
+
+            cv::Mat correctedLuminance = applyAdvancedCorrection(luminance(core), maskPlane(masks, 0, core), maskPlane(masks, 1, core), shadowMax, highlightMax);
+
+            StageTimer timer(stageStats, "convert to BGR", tile.area(), 0);
+            cv::Mat inputTile = inputImage(tile), outputTile = result(tile);
+            forEachRowBand(tile.height, [&](int rowBegin, int rowEnd) { ColorConverter::ReplaceLuminance(inputTile, correctedLuminance, 255.0f, outputTile, rowBegin, rowEnd); });
+        }
     }
 
     /// <summary>
-    /// Applies the filter to an image
+    /// Splits the image into tile cores whose windows (core plus halo) fit the memory budget
     /// </summary>
-    /// <param name="inputImage">Input BGR image</param>
-    /// <returns>Processed image</returns>
-    /// <exception cref="std::invalid_argument">If input image is empty</exception>
-    cv::Mat apply(const cv::Mat& inputImage) 
+    /// <param name="imageSize">Image size</param>
+    /// <param name="halo">Halo width on each side</param>
+    /// <param name="align">Tile sizes are multiples of it, so the reduced mask grid of every window matches the full frame</param>
+    /// <returns>Tile cores covering the image</returns>
+    /// <exception cref="std::invalid_argument">If the budget cannot hold a tile with its halo</exception>
+    std::vector<cv::Rect> splitIntoTiles(cv::Size imageSize, int halo, int align) const
     {
-        if (inputImage.empty())
-            throw std::invalid_argument("Input image is empty");
+        const int minimumTile = 16;
+        size_t budgetPixels = memoryBudget / workingBytesPerPixel;
 
-        cv::Mat labImage = ColorConverter::BGR2Lab(inputImage);
+        // Full-width strips when they fit, square windows otherwise
+        int side = (int)std::sqrt((double)budgetPixels);
+        int windowWidth = std::min(imageSize.width, side);
+        int tileWidth = (windowWidth == imageSize.width) ? imageSize.width : windowWidth - 2 * halo;
+        int tileHeight = std::min(imageSize.height, (int)(budgetPixels / std::min(imageSize.width, tileWidth + 2 * halo)) - 2 * halo);
 
-        std::vector<cv::Mat> labChannels = LabImageProcessor::splitLab(labImage);
-        cv::Mat luminance = labChannels[0];
+        if (tileWidth < imageSize.width)
+            tileWidth -= tileWidth % align;
+        if (tileHeight < imageSize.height)
+            tileHeight -= tileHeight % align;
 
-        cv::Mat luminanceFloat = normalizeLuminance(luminance);
+        if (tileWidth < std::min(minimumTile, imageSize.width) || tileHeight < std::min(minimumTile, imageSize.height))
+            throw std::invalid_argument("Memory budget is too small for the blur radius");
 
-        cv::Mat shadowMask = createAdvancedShadowMask(luminanceFloat);
-        cv::Mat highlightMask = createAdvancedHighlightMask(luminanceFloat);
+        std::vector<cv::Rect> tiles;
+        for (int y = 0; y < imageSize.height; y += tileHeight)
+            for (int x = 0; x < imageSize.width; x += tileWidth)
+                tiles.push_back(cv::Rect(x, y, std::min(tileWidth, imageSize.width - x), std::min(tileHeight, imageSize.height - y)));
 
-        cv::Mat correctedLuminance = applyAdvancedCorrection(luminanceFloat, shadowMask, highlightMask);
+        return tiles;
+    }
 
-        return convertBackToBGR(correctedLuminance, labChannels);
+    /// <summary>
+    /// Distance over which the mask blurs reach, the halo a tile needs.
+    /// Rounded up to maskAlignment so windows start on the reduced grids.
+    /// </summary>
+    /// <returns>Halo in pixels</returns>
+    int maskHalo() const
+    {
+        int halo = std::max(shadowHalo(), highlightHalo()), align = maskAlignment();
+        return (halo + align - 1) / align * align;
     }
 
     /// <summary>
-    /// Sets the shadow lightening power
+    /// Coarsest grid reduction of the two masks; the scales are powers of 2,
+    /// so a multiple of it is a multiple of both
     /// </summary>
-    /// <param name="amount">Value from 0.0 to 1.0</param>
-    void setShadowAmount(float amount) 
-    { 
-        shadowAmount = std::max(0.0f, std::min(1.0f, amount)); 
+    /// <returns>1, 2, 4 or 8</returns>
+    int maskAlignment() const
+    {
+        return std::max(maskScale(shadowBlurRadius()), maskScale(highlightBlurRadius()));
     }
 
     /// <summary>
-    /// Sets the highlight darkening power
+    /// Reach of the shadow mask blur
     /// </summary>
-    /// <param name="amount">Value from 0.0 to 1.0</param>
-    void setHighlightAmount(float amount) 
-    { 
-        highlightAmount = std::max(0.0f, std::min(1.0f, amount)); 
+    /// <returns>Halo in pixels</returns>
+    int shadowHalo() const
+    {
+        return (blurRadius > 0.1f) ? maskSupport(shadowBlurRadius()) : 0;
     }
 
     /// <summary>
-    /// Sets the tonal width
+    /// Reach of the highlight mask blur
     /// </summary>
-    /// <param name="width">Value from 0.0 to 1.0</param>
-    void setTonalWidth(float width) 
-    { 
-        tonalWidth = std::max(0.0f, std::min(1.0f, width)); 
+    /// <returns>Halo in pixels</returns>
+    int highlightHalo() const
+    {
+        return (blurRadius > 0.1f) ? maskSupport(highlightBlurRadius()) : 0;
     }
 
     /// <summary>
-    /// Sets the blur radius for masks
+    /// Blur radius of the shadow mask at full resolution
     /// </summary>
-    /// <param name="radius">Value from 0.0 to 50.0</param>
-    void setBlurRadius(float radius) 
-    { 
-        blurRadius = std::max(0.0f, std::min(50.0f, radius)); 
+    /// <returns>Radius in pixels</returns>
+    float shadowBlurRadius() const
+    {
+        return blurRadius * 1.5f;
     }
 
     /// <summary>
-    /// Prints current filter settings
+    /// Blur radius of the highlight mask at full resolution
     /// </summary>
-    void printCurrentSettings() const 
+    /// <returns>Radius in pixels</returns>
+    float highlightBlurRadius() const
     {
-        std::cout << "Current Shadow/Highlights parameters:\nShadow Amount: " << shadowAmount * 100 << "%\nHighlight Amount: " << highlightAmount * 100 << "%\nTonal Width: " << tonalWidth << "\nBlur Radius: " << blurRadius << " px";
+        return std::min(blurRadius, 20.0f);
     }
-private:
 
     /// <summary>
-    /// Normalizes luminance values to range 0-1
+    /// Full-resolution reach of a mask blurred on the grid reduced by maskScale.
+    /// A reduced sample averages a block of scale pixels, and the bilinear
+    /// upsampling reads the two nearest samples, which adds two blocks.
     /// </summary>
-    /// <param name="luminance">Lab channel luminance matrix</param>
-    /// <returns>Normalized luminance matrix</returns>
-	cv::Mat normalizeLuminance(const cv::Mat& luminance) const
-	{
-		cv::Mat result(luminance.size(), CV_32F);
+    /// <param name="radius">Blur radius at full resolution</param>
+    /// <returns>Reach in pixels, a multiple of the scale</returns>
+    int maskSupport(float radius) const
+    {
+        int scale = maskScale(radius);
+        return (scale == 1) ? blurSupport(radius, 1) : (blurSupport(radius, scale) + 2) * scale;
+    }
 
-		for (int y = 0; y < luminance.rows; y++)
-			for (int x = 0; x < luminance.cols; x++) 
-			{
-				float value = luminance.at<float>(y, x) / 255.0f;
-				result.at<float>(y, x) = value;
-			}
+    /// <summary>
+    /// Picks the grid reduction for the masks from the error budget.
+    ///
+    /// A step blurred with a Gaussian of sigma has a second derivative of at
+    /// most 0.24 / sigma^2, so linear interpolation between samples h apart
+    /// is off by up to h^2 / 8 of that, about 0.03 h^2 / sigma^2. The
+    /// cascade kernels are cut at one sigma, which leaves kinks at the edges
+    /// of their support, and the block averaging widens the blur; measured
+    /// at corners of hard full-contrast edges the worst error stays below
+    /// 0.5 scale^2 / sigma^2. The recursive blur and the box cascade cost
+    /// the same at any radius, so they always run at full resolution.
+    /// </summary>
+    /// <param name="radius">Blur radius of the mask at full resolution</param>
+    /// <returns>1, 2, 4 or 8</returns>
+    int maskScale(float radius) const
+    {
+        if (maskErrorBudget <= 0.0f || radius < 1.0f || blurMode != BlurMode::Exact)
+            return 1;
 
-		return result;
-	}
+        float sigma = cascadeSigma(radius);
+
+        for (int scale = 8; scale > 1; scale /= 2)
+            if (0.5f * scale * scale / (sigma * sigma) <= maskErrorBudget)
+                return scale;
+
+        return 1;
+    }
+
+    /// <summary>
+    /// Checks from luminance alone that the blurred shadow mask reaches exactly 1
+    /// </summary>
+    /// <param name="luminance">Luminance of a window</param>
+    /// <param name="core">Part of the window whose pixels are tested, at least a halo away from cut edges</param>
+    /// <returns>True if the maximum is proven to be 1, false if unknown</returns>
+    bool shadowMaxIsOne(const cv::Mat& luminance, cv::Rect core) const
+    {
+        float shadowThreshold = 0.4f * tonalWidth;
+        return blurMode == BlurMode::Exact && hasSaturatedBlock(luminance, core, shadowHalo(), [&](float lum) { return lum <= shadowThreshold * 0.6f; });
+    }
+
+    /// <summary>
+    /// Checks from luminance alone that the blurred highlight mask reaches exactly 1
+    /// </summary>
+    /// <param name="luminance">Luminance of a window</param>
+    /// <param name="core">Part of the window whose pixels are tested, at least a halo away from cut edges</param>
+    /// <returns>True if the maximum is proven to be 1, false if unknown</returns>
+    bool highlightMaxIsOne(const cv::Mat& luminance, cv::Rect core) const
+    {
+        float highlightThreshold = 1.0f - 0.5f * tonalWidth;
+        return blurMode == BlurMode::Exact && hasSaturatedBlock(luminance, core, highlightHalo(), [&](float lum) { return lum >= highlightThreshold; });
+    }
+
+    /// <summary>
+    /// Looks for a core pixel whose whole blur neighbourhood (the square of
+    /// the halo, cut at the image edge) has mask value 1.
+    ///
+    /// The exact blur divides a weighted sum by the sum of the same weights,
+    /// accumulated in the same order. For inputs of at most 1 the rounded sum
+    /// never exceeds the weight sum, and for inputs of exactly 1 it equals it,
+    /// so every blurred value is at most 1 and such a pixel stays exactly 1
+    /// through the whole cascade. Averaging a block of ones and interpolating
+    /// between equal samples are exact too, so this also holds on a reduced
+    /// grid with the halo of maskSupport. The maximum is then 1 without
+    /// building the mask. The test streams over rows with a run counter per column.
+    /// </summary>
+    /// <param name="luminance">Luminance of a window</param>
+    /// <param name="core">Part of the window whose pixels are tested</param>
+    /// <param name="halo">Blur reach in pixels</param>
+    /// <param name="isSaturated">True for luminance classified as mask value 1</param>
+    /// <returns>True if such a pixel exists</returns>
+    template <typename Predicate>
+    bool hasSaturatedBlock(const cv::Mat& luminance, cv::Rect core, int halo, Predicate isSaturated) const
+    {
+        StageTimer timer(stageStats, "mask proof", luminance.total(), 0);
+        const int rows = luminance.rows, cols = luminance.cols;
+        cv::Mat counters = newPlane(1, cols + 1 + core.width, CV_32S, timer);
+        int* unsaturatedBefore = counters.ptr<int>(0);
+        int* saturatedRows = unsaturatedBefore + cols + 1;
+        std::fill(unsaturatedBefore, unsaturatedBefore + cols + 1 + core.width, 0);
+
+        for (int r = 0; r < rows; r++)
+        {
+            const float* row = luminance.ptr<float>(r);
+            for (int x = 0; x < cols; x++)
+                unsaturatedBefore[x + 1] = unsaturatedBefore[x] + (isSaturated(row[x]) ? 0 : 1);
+
+            // Consecutive rows up to r whose span [x - halo, x + halo] is saturated
+            for (int i = 0; i < core.width; i++)
+            {
+                int x = core.x + i;
+                bool saturated = unsaturatedBefore[std::min(cols, x + halo + 1)] == unsaturatedBefore[std::max(0, x - halo)];
+                saturatedRows[i] = saturated ? saturatedRows[i] + 1 : 0;
+            }
+
+            // Centers whose square ends on row r: y = r - halo, and on the last row every y below it
+            int yBegin = std::max(core.y, r - halo);
+            int yEnd = std::min(core.y + core.height, (r == rows - 1) ? rows : r - halo + 1);
+
+            for (int y = yBegin; y < yEnd; y++)
+            {
+                int needed = r - std::max(0, y - halo) + 1;
+                for (int i = 0; i < core.width; i++)
+                    if (saturatedRows[i] >= needed)
+                        return true;
+            }
+        }
+
+        return false;
+    }
 
     /// <summary>
-    /// Denormalizes luminance values to range 0-255
+    /// Finds the maxima of both masks in one reduction over row bands
     /// </summary>
-    /// <param name="normalizedLuminance">Normalized luminance matrix</param>
-    /// <returns>Denormalized luminance matrix</returns>
-	cv::Mat denormalizeLuminance(const cv::Mat& normalizedLuminance) 
+    /// <param name="shadowMask">Shadow mask</param>
+    /// <param name="highlightMask">Highlight mask of the same size</param>
+    /// <param name="shadowMax">Maximum of the shadow mask</param>
+    /// <param name="highlightMax">Maximum of the highlight mask</param>
+    void maskMaxima(const cv::Mat& shadowMask, const cv::Mat& highlightMask, double& shadowMax, double& highlightMax) const
+    {
+        StageTimer timer(stageStats, "mask maxima", shadowMask.total() + highlightMask.total(), 0);
+        float maxima[2] = { -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity() };
+        std::mutex maxMutex;
+
+        forEachRowBand(shadowMask.rows, [&](int rowBegin, int rowEnd)
+            {
+                float bandMax[2] = { -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity() };
+
+                for (int y = rowBegin; y < rowEnd; y++)
+                {
+                    const float* shadow = shadowMask.ptr<float>(y);
+                    const float* highlight = highlightMask.ptr<float>(y);
+
+                    for (int x = 0; x < shadowMask.cols; x++)
+                        bandMax[0] = std::max(bandMax[0], shadow[x]);
+                    for (int x = 0; x < highlightMask.cols; x++)
+                        bandMax[1] = std::max(bandMax[1], highlight[x]);
+                }
+
+                std::lock_guard<std::mutex> lock(maxMutex);
+                maxima[0] = std::max(maxima[0], bandMax[0]);
+                maxima[1] = std::max(maxima[1], bandMax[1]);
+            });
+
+        shadowMax = maxima[0];
+        highlightMax = maxima[1];
+    }
+
+    /// <summary>
+    /// Computes L of the input image normalized to range 0-1.
+    /// a and b are not stored, convertBackToBGR recomputes them from the input.
+    /// </summary>
+    /// <param name="inputImage">Input BGR image</param>
+    /// <returns>Normalized luminance matrix</returns>
+	cv::Mat convertToLuminance(const cv::Mat& inputImage) const
 	{
-		cv::Mat result(normalizedLuminance.size(), CV_32F);
+		StageTimer timer(stageStats, "luminance", inputImage.total(), 0);
+		cv::Mat result = newPlane(inputImage.rows, inputImage.cols, CV_32F, timer);
 
-		for (int y = 0; y < normalizedLuminance.rows; y++)
-			for (int x = 0; x < normalizedLuminance.cols; x++) 
+		forEachRowBand(inputImage.rows, [&](int rowBegin, int rowEnd)
 			{
-				float value = normalizedLuminance.at<float>(y, x) * 255.0f;
-				result.at<float>(y, x) = value;
-			}
+				for (int y = rowBegin; y < rowEnd; y++)
+				{
+					ColorConverter::BGR2Luminance(inputImage, result, y, y + 1);
+
+					float* row = result.ptr<float>(y);
+					for (int x = 0; x < result.cols; x++) 
+						row[x] = row[x] / 255.0f;
+				}
+			});
 
 		return result;
 	}
 
     /// <summary>
-    /// Applies advanced luminance correction using masks
+    /// Applies advanced luminance correction using masks.
+    /// The masks are normalized by their maxima on the fly.
     /// </summary>
     /// <param name="luminance">Luminance matrix</param>
-    /// <param name="shadowMask">Shadow mask</param>
-    /// <param name="highlightMask">Highlight mask</param>
+    /// <param name="shadowMask">Blurred shadow mask</param>
+    /// <param name="highlightMask">Blurred highlight mask</param>
+    /// <param name="shadowMax">Maximum of the whole shadow mask</param>
+    /// <param name="highlightMax">Maximum of the whole highlight mask</param>
     /// <returns>Corrected luminance matrix</returns>
-    cv::Mat applyAdvancedCorrection(const cv::Mat& luminance, const cv::Mat& shadowMask, const cv::Mat& highlightMask) const
+    cv::Mat applyAdvancedCorrection(const cv::Mat& luminance, const cv::Mat& shadowMask, const cv::Mat& highlightMask, double shadowMax, double highlightMax) const
     {
-        cv::Mat result = luminance.clone();
+        StageTimer timer(stageStats, "correction", luminance.total(), 0);
+        cv::Mat result = newPlane(luminance.rows, luminance.cols, CV_32F, timer);
 
-        for (int y = 0; y < result.rows; y++)
-            for (int x = 0; x < result.cols; x++)
+        float shadowScale = (shadowMax > 0) ? (float)(1.0 / shadowMax) : 1.0f;
+        float highlightScale = (highlightMax > 0) ? (float)(1.0 / highlightMax) : 1.0f;
+
+        forEachRowBand(result.rows, [&](int rowBegin, int rowEnd)
             {
-                float lum = luminance.at<float>(y, x), shadow = shadowMask.at<float>(y, x), highlight = highlightMask.at<float>(y, x);
+                for (int y = rowBegin; y < rowEnd; y++)
+                {
+                    const float* shadowRow = shadowMask.ptr<float>(y);
+                    const float* highlightRow = highlightMask.ptr<float>(y);
 
-                float shadowCorrection = shadowAmount * shadow * (1.0f - lum) * 0.3f, highlightCorrection = highlightAmount * highlight * lum * 0.3f;
+                    for (int x = 0; x < result.cols; x++)
+                    {
+                        float lum = luminance.at<float>(y, x), shadow = shadowRow[x] * shadowScale, highlight = highlightRow[x] * highlightScale;
 
-                float corrected = lum + shadowCorrection - highlightCorrection;
+                        float shadowCorrection = shadowAmount * shadow * (1.0f - lum) * 0.3f, highlightCorrection = highlightAmount * highlight * lum * 0.3f;
 
-                float minVal = lum * 0.5f, maxVal = 1.0f - (1.0f - lum) * 0.5f;
+                        float corrected = lum + shadowCorrection - highlightCorrection;
 
-                result.at<float>(y, x) = std::max(minVal, std::min(maxVal, corrected));
-            }
+                        float minVal = lum * 0.5f, maxVal = 1.0f - (1.0f - lum) * 0.5f;
+
+                        result.at<float>(y, x) = std::max(minVal, std::min(maxVal, corrected));
+                    }
+                }
+            });
 
         return result;
     }
 
     /// <summary>
-    /// Converts back to BGR color space
+    /// Converts back to BGR color space: puts the corrected L (scaled back to 0-255)
+    /// under the a and b of each input pixel in one pass per row
     /// </summary>
-    /// <param name="correctedLuminance">Corrected luminance</param>
-    /// <param name="labChannels">Lab image channels</param>
-    /// <returns>BGR image</returns>
-	cv::Mat convertBackToBGR(const cv::Mat& correctedLuminance, std::vector<cv::Mat>& labChannels) 
+    /// <param name="inputImage">Input BGR image</param>
+    /// <param name="correctedLuminance">Corrected normalized luminance</param>
+    /// <param name="result">Allocated BGR image of the input size, may be the input</param>
+	void convertBackToBGR(const cv::Mat& inputImage, const cv::Mat& correctedLuminance, cv::Mat& result) const
 	{
-		cv::Mat denormalizedLuminance = denormalizeLuminance(correctedLuminance);
-		labChannels[0] = denormalizedLuminance;
-		cv::Mat resultLab = LabImageProcessor::mergeLab(labChannels);
-		return ColorConverter::Lab2BGR(resultLab);
+		StageTimer timer(stageStats, "convert to BGR", inputImage.total(), 0);
+		forEachRowBand(result.rows, [&](int rowBegin, int rowEnd) { ColorConverter::ReplaceLuminance(inputImage, correctedLuminance, 255.0f, result, rowBegin, rowEnd); });
 	}
 
     /// <summary>
-    /// Applies Gaussian blur to an image
+    /// Creates the 1D kernel used for a blur radius
     /// </summary>
-    /// <param name="input">Input image</param>
-    /// <param name="radius">Blur radius</param>
-    /// <returns>Blurred image</returns>
-    cv::Mat applyGaussianBlur(const cv::Mat& input, float radius) const 
+    /// <param name="radius">Blur radius, also used as sigma</param>
+    /// <returns>Gaussian kernel truncated at the radius</returns>
+    static std::vector<float> createBlurKernel(float radius)
+    {
+        return GaussianBlur::createKernel(2 * blurKernelRadius(radius, 1) + 1, radius);
+    }
+
+    /// <summary>
+    /// Half-width of the kernel createBlurKernel builds, without building it
+    /// </summary>
+    /// <param name="radius">Blur radius at full resolution</param>
+    /// <param name="scale">Grid reduction</param>
+    /// <returns>Taps on each side of the center</returns>
+    static int blurKernelRadius(float radius, int scale)
     {
-        if (radius < 0.1f) 
-            return input.clone();
+        int radiusTaps = std::max(3, (int)(radius * 2 + 1) | 1) / 2;
+        return (radiusTaps + scale - 1) / scale;
+    }
+
+    /// <summary>
+    /// Creates the kernel of a blur radius for a grid reduced by scale. Each
+    /// full-resolution tap is split between the two nearest reduced taps by
+    /// linear interpolation, which keeps the truncated shape of the kernel
+    /// instead of truncating a narrower Gaussian on the coarse grid.
+    /// </summary>
+    /// <param name="radius">Blur radius at full resolution</param>
+    /// <param name="scale">Grid reduction</param>
+    /// <returns>Kernel on the reduced grid, not normalized</returns>
+    static std::vector<float> createBlurKernel(float radius, int scale)
+    {
+        std::vector<float> kernel = createBlurKernel(radius);
+        if (scale == 1)
+            return kernel;
+
+        const int radiusTaps = (int)kernel.size() / 2, reducedRadius = blurKernelRadius(radius, scale);
+        std::vector<float> reduced(2 * reducedRadius + 1, 0.0f);
 
-        cv::Mat result = input.clone();
-        int kernelSize = std::max(3, (int)(radius * 2 + 1) | 1);
+        for (int k = -radiusTaps; k <= radiusTaps; k++)
+        {
+            int first = (int)std::floor((float)k / scale);
+            float t = (float)(k - first * scale) / scale;
 
-        cv::Mat kernel = createGaussianKernel(kernelSize, radius);
+            reduced[first + reducedRadius] += kernel[k + radiusTaps] * (1.0f - t);
+            if (t > 0.0f)
+                reduced[first + 1 + reducedRadius] += kernel[k + radiusTaps] * t;
+        }
 
-        return applyConvolution(result, kernel);
+        return reduced;
     }
 
     /// <summary>
-    /// Creates Gaussian kernel for blurring
+    /// Creates the shadow and highlight masks in one pass over luminance and
+    /// blurs them together, without normalization. The masks are two planes
+    /// side by side in one buffer (see GaussianBlur::applyPair), so both share
+    /// every blur pass while each keeps contiguous rows. With a mask error
+    /// budget each mask may be blurred on a reduced grid (see maskScale).
     /// </summary>
-    /// <param name="size">Kernel size</param>
-    /// <param name="sigma">Standard deviation</param>
-    /// <returns>Gaussian kernel</returns>
-    cv::Mat createGaussianKernel(int size, float sigma) const
+    /// <param name="luminance">Luminance matrix</param>
+    /// <returns>Blurred masks (CV_32F, twice as wide): shadow on the left, highlight on the right; see maskPlane</returns>
+    cv::Mat createMasks(const cv::Mat& luminance) const
     {
-        cv::Mat kernel(size, size, CV_32F);
-        int center = size / 2;
-        float sum = 0.0f;
+        int shadowScale = maskScale(shadowBlurRadius()), highlightScale = maskScale(highlightBlurRadius());
 
-        for (int y = 0; y < size; y++)
-            for (int x = 0; x < size; x++) 
-            {
-                float dx = x - center;
-                float dy = y - center;
-                float value = exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
-                kernel.at<float>(y, x) = value;
-                sum += value;
-            }
-        kernel /= sum;
-        return kernel;
+        if (shadowScale == highlightScale)
+            return createMasks(luminance, shadowScale, shadowBlurRadius(), highlightBlurRadius());
+
+        // The highlight radius is capped, so the shadow mask can take a coarser
+        // grid. The highlight mask is built first with the shadow mask left
+        // unblurred, then the shadow mask is replaced from its own grid.
+        cv::Mat masks = createMasks(luminance, highlightScale, 0.0f, highlightBlurRadius());
+        cv::Mat shadows = applyMaskBlur(classifyReduced(luminance, shadowScale), shadowBlurRadius(), 0.0f, shadowScale);
+        StageTimer timer(stageStats, "upsample masks", luminance.total(), 0);
+        upsampleMasks(shadows, shadowScale, masks, 0, 1);
+
+        return masks;
     }
 
     /// <summary>
-    /// Applies convolution with image border handling
+    /// Creates both masks on a grid reduced by scale and brings them back to full resolution
     /// </summary>
-    /// <param name="input">Input image</param>
-    /// <param name="kernel">Convolution kernel</param>
-    /// <returns>Convolution result</returns>
-    cv::Mat applyConvolution(const cv::Mat& input, const cv::Mat& kernel) const
+    /// <param name="luminance">Luminance matrix</param>
+    /// <param name="scale">Grid reduction, 1 for full resolution</param>
+    /// <param name="shadowRadius">Blur radius of the shadow mask at full resolution</param>
+    /// <param name="highlightRadius">Blur radius of the highlight mask at full resolution</param>
+    /// <returns>Blurred masks side by side</returns>
+    cv::Mat createMasks(const cv::Mat& luminance, int scale, float shadowRadius, float highlightRadius) const
     {
-        cv::Mat result = cv::Mat::zeros(input.size(), input.type());
-        int kernelRadius = kernel.rows / 2;
-        int pixelsProcessed = 0;
-        int edgePixels = 0;
+        if (scale > 1)
+        {
+            cv::Mat reduced = applyMaskBlur(classifyReduced(luminance, scale), shadowRadius, highlightRadius, scale);
+            StageTimer timer(stageStats, "upsample masks", 2 * luminance.total(), 0);
+            cv::Mat masks = newPlane(luminance.rows, 2 * luminance.cols, CV_32F, timer);
+            upsampleMasks(reduced, scale, masks, 0, 2);
+            return masks;
+        }
 
-        for (int y = 0; y < input.rows; y++)
-            for (int x = 0; x < input.cols; x++) 
-            {
-                float sum = 0.0f, weightSum = 0.0f;
-                bool isEdgePixel = false;
+        const int width = luminance.cols;
+        cv::Mat masks;
 
-                for (int ky = -kernelRadius; ky <= kernelRadius; ky++)
-                    for (int kx = -kernelRadius; kx <= kernelRadius; kx++) 
-                    {
-                        int srcY = y + ky, srcX = x + kx;
+        {
+            StageTimer timer(stageStats, "classify masks", 2 * luminance.total(), 0);
+            masks = newPlane(luminance.rows, 2 * width, CV_32F, timer);
 
-                        if (srcY >= 0 && srcY < input.rows && srcX >= 0 && srcX < input.cols) 
-                        {
-                            float pixel = input.at<float>(srcY, srcX);
-                            float weight = kernel.at<float>(ky + kernelRadius, kx + kernelRadius);
-                            sum += pixel * weight;
-                            weightSum += weight;
-                        }
-                        else
-                            isEdgePixel = true;
+            forEachRowBand(luminance.rows, [&](int rowBegin, int rowEnd)
+                {
+                    for (int y = rowBegin; y < rowEnd; y++)
+                    {
+                        float* shadow = masks.ptr<float>(y);
+                        classifyRow(luminance.ptr<float>(y), width, shadow, shadow + width);
                     }
+                });
+        }
 
-                if (weightSum > 0.0f)
-                    result.at<float>(y, x) = sum / weightSum;
-                else
-                    result.at<float>(y, x) = input.at<float>(y, x);
-
-                pixelsProcessed++;
-                if (isEdgePixel)
-                    edgePixels++;
-            }
-        return result;
+        return applyMaskBlur(masks, shadowRadius, highlightRadius, 1);
     }
 
     /// <summary>
-    /// Creates enhanced shadow mask
+    /// Classifies a row of luminance into shadow and highlight mask values
     /// </summary>
-    /// <param name="luminance">Luminance matrix</param>
-    /// <returns>Shadow mask</returns>
-    cv::Mat createAdvancedShadowMask(const cv::Mat& luminance) const
+    /// <param name="luminance">Luminance row</param>
+    /// <param name="count">Number of pixels</param>
+    /// <param name="shadow">Shadow mask row</param>
+    /// <param name="highlight">Highlight mask row</param>
+    void classifyRow(const float* luminance, int count, float* shadow, float* highlight) const
     {
         float shadowThreshold = 0.4f * tonalWidth;
-        cv::Mat smoothMask(luminance.size(), CV_32F);
+        float highlightThreshold = 1.0f - 0.5f * tonalWidth;
 
-        for (int y = 0; y < luminance.rows; y++)
-            for (int x = 0; x < luminance.cols; x++) {
-                float lum = luminance.at<float>(y, x);
+        for (int x = 0; x < count; x++) 
+        {
+            float lum = luminance[x];
 
-                if (lum <= shadowThreshold * 0.6f)
-                    smoothMask.at<float>(y, x) = 1.0f;
-                else if (lum <= shadowThreshold) 
-                {
-                    float t = (lum - shadowThreshold * 0.6f) / (shadowThreshold * 0.4f);
-                    smoothMask.at<float>(y, x) = 1.0f - t * 0.5f;
-                }
-                else
-                    smoothMask.at<float>(y, x) = 0.0f;
+            if (lum <= shadowThreshold * 0.6f)
+                shadow[x] = 1.0f;
+            else if (lum <= shadowThreshold) 
+            {
+                float t = (lum - shadowThreshold * 0.6f) / (shadowThreshold * 0.4f);
+                shadow[x] = 1.0f - t * 0.5f;
             }
+            else
+                shadow[x] = 0.0f;
 
-        if (blurRadius > 0.1f) 
-        {
-            float effectiveRadius = blurRadius * 1.5f;
-            smoothMask = applyFastGaussianBlur(smoothMask, effectiveRadius);
+            if (lum >= highlightThreshold)
+                highlight[x] = 1.0f;
+            else if (lum >= highlightThreshold * 0.9f) 
+            {
+                float t = (lum - highlightThreshold * 0.9f) / (highlightThreshold * 0.1f);
+                highlight[x] = t;
+            }
+            else
+                highlight[x] = 0.0f;
         }
-
-        double minVal, maxVal;
-        cv::minMaxLoc(smoothMask, &minVal, &maxVal);
-        if (maxVal > 0)
-            smoothMask /= maxVal;
-
-        return smoothMask;
     }
 
     /// <summary>
-    /// Creates enhanced highlight mask
+    /// Classifies luminance at full resolution and averages the masks over
+    /// scale x scale blocks; blocks cut by the edge average the pixels they have
     /// </summary>
     /// <param name="luminance">Luminance matrix</param>
-    /// <returns>Highlight mask</returns>
-    cv::Mat createAdvancedHighlightMask(const cv::Mat& luminance) const
+    /// <param name="scale">Block size</param>
+    /// <returns>Reduced masks side by side</returns>
+    cv::Mat classifyReduced(const cv::Mat& luminance, int scale) const
     {
-        float highlightThreshold = 1.0f - 0.5f * tonalWidth;
+        const int width = luminance.cols, height = luminance.rows;
+        const int reducedWidth = (width + scale - 1) / scale, reducedHeight = (height + scale - 1) / scale;
+        StageTimer timer(stageStats, "classify masks", 2 * luminance.total(), 0);
+        cv::Mat reduced = newPlane(reducedHeight, 2 * reducedWidth, CV_32F, timer);
 
-        cv::Mat smoothMask(luminance.size(), CV_32F);
+        // Rows are classified in chunks of whole blocks that fit on the stack
+        const int chunk = 256;
 
-        for (int y = 0; y < luminance.rows; y++)
-            for (int x = 0; x < luminance.cols; x++) 
+        forEachRowBand(reducedHeight, [&](int rowBegin, int rowEnd)
             {
-                float lum = luminance.at<float>(y, x);
+                float shadow[chunk], highlight[chunk];
 
-                if (lum >= highlightThreshold)
-                    smoothMask.at<float>(y, x) = 1.0f;
-                else if (lum >= highlightThreshold * 0.9f) 
+                for (int r = rowBegin; r < rowEnd; r++)
                 {
-                    float t = (lum - highlightThreshold * 0.9f) / (highlightThreshold * 0.1f);
-                    smoothMask.at<float>(y, x) = t;
+                    float* reducedShadow = reduced.ptr<float>(r);
+                    float* reducedHighlight = reducedShadow + reducedWidth;
+                    std::fill(reducedShadow, reducedShadow + 2 * reducedWidth, 0.0f);
+
+                    const int yBegin = r * scale, yEnd = std::min(height, yBegin + scale);
+
+                    for (int y = yBegin; y < yEnd; y++)
+                        for (int chunkBegin = 0; chunkBegin < width; chunkBegin += chunk)
+                        {
+                            const int chunkEnd = std::min(width, chunkBegin + chunk);
+                            classifyRow(luminance.ptr<float>(y) + chunkBegin, chunkEnd - chunkBegin, shadow, highlight);
+
+                            for (int i = chunkBegin / scale; i * scale < chunkEnd; i++)
+                                for (int x = i * scale; x < std::min(width, (i + 1) * scale); x++)
+                                {
+                                    reducedShadow[i] += shadow[x - chunkBegin];
+                                    reducedHighlight[i] += highlight[x - chunkBegin];
+                                }
+                        }
+
+                    for (int i = 0; i < reducedWidth; i++)
+                    {
+                        float area = (float)((yEnd - yBegin) * (std::min(width, (i + 1) * scale) - i * scale));
+                        reducedShadow[i] /= area;
+                        reducedHighlight[i] /= area;
+                    }
                 }
-                else
-                    smoothMask.at<float>(y, x) = 0.0f;
-            }
+            });
+
+        return reduced;
+    }
+
+    /// <summary>
+    /// Bilinear upsampling of reduced masks. Sample i covers pixels
+    /// [i * scale, (i + 1) * scale), so its center is at (i + 0.5) * scale;
+    /// pixels past the outer centers take the edge sample. Equal neighbours
+    /// give exactly their value, which keeps the proof of hasSaturatedBlock.
+    /// </summary>
+    /// <param name="reduced">Reduced masks side by side</param>
+    /// <param name="scale">Reduction factor</param>
+    /// <param name="masks">Full-resolution masks side by side, receive the upsampled planes</param>
+    /// <param name="planeBegin">First plane to upsample</param>
+    /// <param name="planeEnd">Plane after the last</param>
+    void upsampleMasks(const cv::Mat& reduced, int scale, cv::Mat& masks, int planeBegin, int planeEnd) const
+    {
+        const int reducedWidth = reduced.cols / 2, width = masks.cols / 2;
 
-        if (blurRadius > 0.1f)
-            smoothMask = applyFastGaussianBlur(smoothMask, std::min(blurRadius, 20.0f));
+        auto samples = [scale](int pixel, int count, int& first, int& second, float& t)
+            {
+                float position = (pixel + 0.5f) / scale - 0.5f;
+                first = std::max(0, (int)std::floor(position));
+                second = std::min(first + 1, count - 1);
+                t = std::max(0.0f, position - first);
+            };
+
+        // Column samples: first and second reduced column and the weight of the second
+        cv::Mat columns = newPlane(2, width, CV_32S), columnWeights = newPlane(1, width, CV_32F);
+        int* x0 = columns.ptr<int>(0);
+        int* x1 = columns.ptr<int>(1);
+        float* tx = columnWeights.ptr<float>(0);
+        for (int x = 0; x < width; x++)
+            samples(x, reducedWidth, x0[x], x1[x], tx[x]);
+
+        forEachRowBand(masks.rows, [&](int rowBegin, int rowEnd)
+            {
+                for (int y = rowBegin; y < rowEnd; y++)
+                {
+                    int y0, y1;
+                    float ty;
+                    samples(y, reduced.rows, y0, y1, ty);
 
-        double minVal, maxVal;
-        cv::minMaxLoc(smoothMask, &minVal, &maxVal);
-        if (maxVal > 0)
-            smoothMask /= maxVal;
+                    for (int plane = planeBegin; plane < planeEnd; plane++)
+                    {
+                        const float* top = reduced.ptr<float>(y0) + plane * reducedWidth;
+                        const float* bottom = reduced.ptr<float>(y1) + plane * reducedWidth;
+                        float* out = masks.ptr<float>(y) + plane * width;
 
-        return smoothMask;
+                        for (int x = 0; x < width; x++)
+                        {
+                            float upper = top[x0[x]] + (top[x1[x]] - top[x0[x]]) * tx[x];
+                            float lower = bottom[x0[x]] + (bottom[x1[x]] - bottom[x0[x]]) * tx[x];
+                            out[x] = upper + (lower - upper) * ty;
+                        }
+                    }
+                }
+            });
     }
 
     /// <summary>
-    /// Applies fast Gaussian blur with iterations
+    /// Blurs both masks in shared passes. Each mask follows its own cascade
+    /// from planBlurIterations; the mask with fewer steps is copied through
+    /// the remaining ones. On a reduced grid the cascade is planned for the
+    /// full-resolution radius and every step is scaled down, so the blur has
+    /// the same shape at any scale. Every step blurs in place through one
+    /// scratch buffer.
     /// </summary>
-    /// <param name="input">Input image</param>
-    /// <param name="radius">Blur radius</param>
-    /// <returns>Blurred image</returns>
-    cv::Mat applyFastGaussianBlur(const cv::Mat& input, float radius) const
+    /// <param name="masks">Masks side by side (see createMasks), overwritten</param>
+    /// <param name="shadowRadius">Blur radius of the shadow mask at full resolution</param>
+    /// <param name="highlightRadius">Blur radius of the highlight mask at full resolution</param>
+    /// <param name="scale">Grid reduction of the masks</param>
+    /// <returns>Blurred masks, the same buffer</returns>
+    cv::Mat applyMaskBlur(cv::Mat masks, float shadowRadius, float highlightRadius, int scale) const
     {
-        if (radius < 1.0f) 
-            return input.clone();
+        int iterations[2] = { 0, 0 };
+        float iterRadius[2] = { 0.0f, 0.0f }, radius[2] = { shadowRadius, highlightRadius };
 
-        cv::Mat result = input.clone();
+        // Radii below 1 are not blurred
+        for (int ch = 0; ch < 2; ch++)
+            if (radius[ch] >= 1.0f)
+                planBlurIterations(radius[ch], iterations[ch], iterRadius[ch]);
 
-        int iterations;
-        float iterRadius;
+        if (iterations[0] == 0 && iterations[1] == 0)
+            return masks;
+
+        // The recursive blur and the box cascade replace each cascade with one blur of equal variance
+        if (blurMode != BlurMode::Exact)
+        {
+            float sigma0 = iterations[0] ? recursiveSigma(iterations[0], iterRadius[0]) / scale : 0.0f;
+            float sigma1 = iterations[1] ? recursiveSigma(iterations[1], iterRadius[1]) / scale : 0.0f;
+            StageTimer timer(stageStats, "mask blur", masks.total(), 0);
+            cv::Mat scratch = newPlane(masks.rows, masks.cols, CV_32F, timer);
+
+            if (blurMode == BlurMode::Recursive)
+                GaussianBlur::applyRecursivePair(masks, masks, scratch, sigma0, sigma1, threadPool.get());
+            else
+                GaussianBlur::applyBoxCascadePair(masks, masks, scratch, sigma0, sigma1, threadPool.get());
+            return masks;
+        }
+
+        // Kernels come from the workspace when there is one, so warm calls do not build them
+        static const std::vector<float> identity(1, 1.0f);
+        std::shared_ptr<const std::vector<float>> held[2];
+        std::vector<float> created[2];
+        const std::vector<float>* kernels[2] = { &identity, &identity };
+
+        for (int ch = 0; ch < 2; ch++)
+            if (iterations[ch] && workspace)
+            {
+                held[ch] = workspace->kernel(iterRadius[ch], scale, [&]() { return createBlurKernel(iterRadius[ch], scale); });
+                kernels[ch] = held[ch].get();
+            }
+            else if (iterations[ch])
+            {
+                created[ch] = createBlurKernel(iterRadius[ch], scale);
+                kernels[ch] = &created[ch];
+            }
+
+        cv::Mat scratch;
+
+        for (int i = 0; i < std::max(iterations[0], iterations[1]); i++)
+        {
+            throwIfOutdated();
+            StageTimer timer(stageStats, "mask blur", masks.total(), 0);
+
+            if (scratch.empty())
+                scratch = newPlane(masks.rows, masks.cols, CV_32F, timer);
+
+            GaussianBlur::applyPair(masks, masks, scratch, (i < iterations[0]) ? *kernels[0] : identity, (i < iterations[1]) ? *kernels[1] : identity, threadPool.get());
+        }
+
+        return masks;
+    }
+
+    /// <summary>
+    /// View of one mask inside the side-by-side buffer from createMasks
+    /// </summary>
+    /// <param name="masks">Masks side by side</param>
+    /// <param name="plane">0 for the shadow mask, 1 for the highlight mask</param>
+    /// <param name="area">Area of the mask to view</param>
+    /// <returns>View without copy</returns>
+    static cv::Mat maskPlane(const cv::Mat& masks, int plane, cv::Rect area)
+    {
+        return masks(cv::Rect(area.x + plane * masks.cols / 2, area.y, area.width, area.height));
+    }
 
+    /// <summary>
+    /// Splits a blur radius into a cascade of smaller blurs
+    /// </summary>
+    /// <param name="radius">Blur radius</param>
+    /// <param name="iterations">Number of blurs in the cascade</param>
+    /// <param name="iterRadius">Radius of each blur</param>
+    static void planBlurIterations(float radius, int& iterations, float& iterRadius)
+    {
         if (radius <= 8.0f) 
         {
             iterations = 1;
@@ -394,10 +1738,58 @@ private:
             iterations = 3;
             iterRadius = radius / 3.0f;
         }
+    }
 
-        for (int i = 0; i < iterations; i++)
-            result = applyGaussianBlur(result, iterRadius);
+    /// <summary>
+    /// Sigma of the recursive blur or box cascade that matches the variance of the cascade
+    /// </summary>
+    /// <param name="iterations">Number of blurs in the cascade</param>
+    /// <param name="iterRadius">Radius of each blur</param>
+    /// <returns>Sigma</returns>
+    float recursiveSigma(int iterations, float iterRadius) const
+    {
+        if (!workspace)
+            return std::sqrt(iterations * GaussianBlur::kernelVariance(createBlurKernel(iterRadius)));
 
-        return result;
+        std::shared_ptr<const std::vector<float>> kernel = workspace->kernel(iterRadius, 1, [&]() { return createBlurKernel(iterRadius); });
+        return std::sqrt(iterations * GaussianBlur::kernelVariance(*kernel));
+    }
+
+    /// <summary>
+    /// Sigma of the whole cascade for a blur radius
+    /// </summary>
+    /// <param name="radius">Blur radius, at least 1</param>
+    /// <returns>Sigma</returns>
+    float cascadeSigma(float radius) const
+    {
+        int iterations;
+        float iterRadius;
+        planBlurIterations(radius, iterations, iterRadius);
+        return recursiveSigma(iterations, iterRadius);
+    }
+
+    /// <summary>
+    /// Distance in grid samples over which applyMaskBlur mixes values of one channel.
+    /// The cascade and the box cascade reach exactly the sum of their kernel
+    /// radii; the recursive blur has no finite support and is cut at 4 sigma.
+    /// </summary>
+    /// <param name="radius">Blur radius at full resolution</param>
+    /// <param name="scale">Grid reduction of the masks</param>
+    /// <returns>Support in samples of the reduced grid</returns>
+    int blurSupport(float radius, int scale) const
+    {
+        if (radius < 1.0f)
+            return 0;
+
+        int iterations;
+        float iterRadius;
+        planBlurIterations(radius, iterations, iterRadius);
+
+        if (blurMode == BlurMode::Recursive)
+            return (int)std::ceil(4.0f * recursiveSigma(iterations, iterRadius) / scale);
+        if (blurMode == BlurMode::BoxCascade)
+            return GaussianBlur::boxCascadeSupport(recursiveSigma(iterations, iterRadius) / scale);
+
+        return iterations * blurKernelRadius(iterRadius, scale);
     }
-};
\ No newline at end of file
+};
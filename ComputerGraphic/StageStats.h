@@ -0,0 +1,119 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstddef>
+
+/// <summary>
+/// Measurements of one stage run
+/// </summary>
+struct StageRecord
+{
+    /// <summary>Stage name, repeated for stages that run several times (blur steps, tiles)</summary>
+    std::string name;
+
+    /// <summary>Wall time</summary>
+    double milliseconds = 0.0;
+
+    /// <summary>Bytes of the planes the stage allocated</summary>
+    size_t bytesAllocated = 0;
+
+    /// <summary>Pixels the stage processed, counting every plane</summary>
+    size_t pixels = 0;
+};
+
+/// <summary>
+/// Stages of one filter call in the order they ran.
+/// Stages served from a cache do not run and are not listed.
+/// </summary>
+struct StageStats
+{
+    std::vector<StageRecord> stages;
+
+    /// <summary>
+    /// Sum of the stage times
+    /// </summary>
+    /// <returns>Time in milliseconds</returns>
+    double totalMilliseconds() const
+    {
+        double total = 0.0;
+        for (const StageRecord& stage : stages)
+            total += stage.milliseconds;
+        return total;
+    }
+
+    /// <summary>
+    /// Sum of the bytes allocated by the stages
+    /// </summary>
+    /// <returns>Bytes</returns>
+    size_t totalBytesAllocated() const
+    {
+        size_t total = 0;
+        for (const StageRecord& stage : stages)
+            total += stage.bytesAllocated;
+        return total;
+    }
+
+    /// <summary>
+    /// Prints one line per stage and the totals
+    /// </summary>
+    void print() const
+    {
+        std::cout << std::left << std::setw(20) << "stage" << std::right << std::setw(12) << "ms" << std::setw(14) << "allocated, KB" << std::setw(14) << "pixels" << "\n";
+
+        for (const StageRecord& stage : stages)
+            std::cout << std::left << std::setw(20) << stage.name << std::right << std::fixed << std::setprecision(3) << std::setw(12) << stage.milliseconds
+                      << std::setw(14) << stage.bytesAllocated / 1024 << std::setw(14) << stage.pixels << "\n";
+
+        std::cout << std::left << std::setw(20) << "total" << std::right << std::setw(12) << totalMilliseconds() << std::setw(14) << totalBytesAllocated() / 1024 << "\n";
+    }
+};
+
+/// <summary>
+/// Records the wall time of a scope as a stage. Without stats it only
+/// stores its arguments, so disabled instrumentation costs a null check.
+/// </summary>
+class StageTimer
+{
+    StageStats* stats;
+    const char* name;
+    size_t bytesAllocated, pixels;
+    std::chrono::steady_clock::time_point start;
+
+public:
+
+    /// <summary>
+    /// Starts timing a stage
+    /// </summary>
+    /// <param name="stats">Receiver of the record, null to record nothing</param>
+    /// <param name="name">Stage name</param>
+    /// <param name="pixels">Pixels the stage processes</param>
+    /// <param name="bytesAllocated">Bytes of the planes the stage allocates</param>
+    StageTimer(StageStats* stats, const char* name, size_t pixels, size_t bytesAllocated)
+        : stats(stats), name(name), bytesAllocated(bytesAllocated), pixels(pixels)
+    {
+        if (stats)
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~StageTimer()
+    {
+        if (stats)
+            stats->stages.push_back({ name, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), bytesAllocated, pixels });
+    }
+
+    /// <summary>
+    /// Counts a plane the stage allocated after the timer started
+    /// </summary>
+    /// <param name="bytes">Bytes of the plane</param>
+    void addAllocation(size_t bytes)
+    {
+        bytesAllocated += bytes;
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+};
@@ -2,8 +2,17 @@
 
 #include <opencv.hpp>
 #include <iostream>
+#include <iomanip>
+#include <fstream>
 #include <string>
+#include <map>
+#include <cmath>
+#include <filesystem>
+#include <atomic>
+#include <functional>
 #include "ShadowHighlightsFilter.h"
+#include "GaussianBlur.h"
+#include "Workspace.h"
 
 /// <summary>
 /// Class for testing Shadow/Highlights filter
@@ -12,6 +21,24 @@ class TestRunner
 {
 public:
 
+    /// <summary>
+    /// Limits of the regression test
+    /// </summary>
+    struct RegressionThresholds
+    {
+        /// <summary>Largest allowed difference of any channel from the golden image, in levels</summary>
+        double maxAbsError = 2.0;
+
+        /// <summary>Lowest allowed PSNR against the golden image, dB</summary>
+        double minPsnr = 45.0;
+
+        /// <summary>Lowest allowed mean SSIM against the golden image</summary>
+        double minSsim = 0.995;
+
+        /// <summary>Allowed slowdown over the recorded time, 0.25 for 25%</summary>
+        double maxSlowdown = 0.25;
+    };
+
     /// <summary>
     /// Runs comprehensive testing of the filter
     /// </summary>
@@ -25,30 +52,22 @@ public:
         // Test 1: Different parameter combinations
         std::cout << "\n--- TEST 1: Different correction parameters ---\n";
 
-        // Case 1: Only shadow lightening
-        std::cout << "\n1. Shadow lightening only (50%)\n";
-        ShadowHighlightsFilter filter1(0.5f, 0.0f);
-        cv::Mat result1 = filter1.apply(originalImage);
+        // The four cases share tonal width and blur radius, so one sweep converts the image and builds the masks once
+        std::vector<ShadowHighlightsFilter::Params> cases = testCases();
 
-        // Case 2: Only highlight darkening
+        std::cout << "\n1. Shadow lightening only (50%)\n";
         std::cout << "\n2. Highlight darkening only (40%)\n";
-        ShadowHighlightsFilter filter2(0.0f, 0.4f);
-        cv::Mat result2 = filter2.apply(originalImage);
-
-        // Case 3: Combined correction
         std::cout << "\n3. Combined correction (30% shadows, 20% highlights)\n";
-        ShadowHighlightsFilter filter3(0.3f, 0.2f);
-        cv::Mat result3 = filter3.apply(originalImage);
-
-        // Case 4: Strong correction
         std::cout << "\n4. Strong correction (70% shadows, 50% highlights)\n";
-        ShadowHighlightsFilter filter4(0.7f, 0.5f);
-        cv::Mat result4 = filter4.apply(originalImage);
+
+        ShadowHighlightsFilter filter;
+        std::vector<cv::Mat> results = filter.applySweep(originalImage, cases);
+        cv::Mat result1 = results[0], result2 = results[1], result3 = results[2], result4 = results[3];
 
         // Test 2: Results visualization
         std::cout << "\n--- TEST 2: Results visualization ---\n";
 
-        cv::Mat finalDisplay = createComparisonMosaic(originalImage, result1, result2, result3, result4);
+        cv::Mat finalDisplay = createComparisonMosaic(originalImage, result1, result2, result3);
         cv::imshow("Shadow/Highlights Filter - Results Comparison", finalDisplay);
 
         // Test 3: Specific areas analysis
@@ -89,6 +108,415 @@ public:
         cv::waitKey(0);
     }
 
+    /// <summary>
+    /// What the regression test does with the golden directory
+    /// </summary>
+    enum class RegressionMode
+    {
+        /// <summary>Checks quality and speed; cases without a recorded time get one in timings.txt</summary>
+        Check,
+
+        /// <summary>Checks quality and records every time anew, leaving the golden images untouched</summary>
+        RecordTimings,
+
+        /// <summary>Records the current outputs as golden images and their times</summary>
+        UpdateGolden
+    };
+
+    /// <summary>
+    /// Runs the cases of the comprehensive test without any window and
+    /// compares each output with its golden image by max abs error, PSNR and
+    /// SSIM. Each case is timed (best of 3, stage cache off) against the time
+    /// recorded in timings.txt. Recording on one machine and checking on
+    /// another makes the timings meaningless, so timings.txt is not kept
+    /// with the golden images: a case without a recorded time is reported
+    /// and its time is written, and later runs check against it. The check
+    /// also fails if a warm filter with a workspace allocates planes (see
+    /// runAllocationTest) or if the Lab channel views and planes disagree
+    /// with splitLab and mergeLab (see runLabLayoutTest).
+    /// </summary>
+    /// <param name="originalImage">Original image the golden images were made from</param>
+    /// <param name="goldenDirectory">Directory with the golden images and timings.txt</param>
+    /// <param name="mode">Check, record the timings only or record the golden images too</param>
+    /// <returns>0 if every case is within the default thresholds, 1 otherwise</returns>
+    static int runRegressionTest(const cv::Mat& originalImage, const std::string& goldenDirectory, RegressionMode mode)
+    {
+        return runRegressionTest(originalImage, goldenDirectory, mode, RegressionThresholds());
+    }
+
+    /// <summary>
+    /// Runs the regression test with explicit thresholds (see the overload above)
+    /// </summary>
+    /// <param name="originalImage">Original image the golden images were made from</param>
+    /// <param name="goldenDirectory">Directory with the golden images and timings.txt</param>
+    /// <param name="mode">Check, record the timings only or record the golden images too</param>
+    /// <param name="thresholds">Quality and speed limits</param>
+    /// <returns>0 if every case is within the thresholds, 1 otherwise</returns>
+    static int runRegressionTest(const cv::Mat& originalImage, const std::string& goldenDirectory, RegressionMode mode, const RegressionThresholds& thresholds)
+    {
+        std::cout << "==========================================\nSHADOW/HIGHLIGHTS REGRESSION TEST\n==========================================\n";
+
+        const bool updateGolden = mode == RegressionMode::UpdateGolden;
+        const std::filesystem::path directory(goldenDirectory);
+        const std::filesystem::path timingsPath = directory / "timings.txt";
+        std::vector<ShadowHighlightsFilter::Params> cases = testCases();
+        std::vector<std::string> names = testCaseNames();
+
+        std::map<std::string, double> baseline;
+        {
+            std::ifstream timingsIn(timingsPath);
+            for (std::string name; timingsIn >> name;)
+                timingsIn >> baseline[name];
+        }
+
+        if (updateGolden)
+            std::filesystem::create_directories(directory);
+
+        std::cout << std::left << std::setw(16) << "case" << std::right << std::setw(10) << "max abs" << std::setw(10) << "PSNR" << std::setw(10) << "SSIM"
+                  << std::setw(12) << "ms" << std::setw(14) << "baseline ms" << "  status\n";
+
+        // Times to write: all of them when recording, otherwise only the missing ones
+        std::map<std::string, double> timings = (mode == RegressionMode::Check) ? baseline : std::map<std::string, double>();
+        bool passed = true;
+
+        for (size_t i = 0; i < cases.size(); i++)
+        {
+            ShadowHighlightsFilter filter(cases[i].shadowAmount, cases[i].highlightAmount, cases[i].tonalWidth, cases[i].blurRadius);
+            filter.setCacheEnabled(false);
+
+            cv::Mat result;
+            double ms = 0.0;
+            for (int run = 0; run < 3; run++)
+            {
+                int64 start = cv::getTickCount();
+                result = filter.apply(originalImage);
+                double runMs = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+                ms = (run == 0) ? runMs : std::min(ms, runMs);
+            }
+
+            const bool hasBaseline = baseline.count(names[i]) != 0;
+            if (mode != RegressionMode::Check || !hasBaseline)
+                timings[names[i]] = ms;
+
+            const std::string goldenPath = (directory / (names[i] + ".png")).string();
+            std::cout << std::left << std::setw(16) << names[i] << std::right << std::fixed;
+
+            if (updateGolden)
+            {
+                bool written = cv::imwrite(goldenPath, result);
+                std::cout << std::setw(42) << std::setprecision(2) << ms << std::setw(14) << "-" << (written ? "  recorded\n" : "  WRITE FAILED\n");
+                passed = passed && written;
+                continue;
+            }
+
+            cv::Mat golden = cv::imread(goldenPath);
+            if (golden.empty() || golden.size() != result.size())
+            {
+                std::cout << std::setw(42) << std::setprecision(2) << ms << std::setw(14) << "-" << "  NO GOLDEN IMAGE\n";
+                passed = false;
+                continue;
+            }
+
+            double maxAbsError, psnr, ssim;
+            compareImages(result, golden, maxAbsError, psnr, ssim);
+
+            bool qualityPassed = maxAbsError <= thresholds.maxAbsError && psnr >= thresholds.minPsnr && ssim >= thresholds.minSsim;
+            bool speedChecked = mode == RegressionMode::Check && hasBaseline;
+            bool speedPassed = !speedChecked || ms <= baseline[names[i]] * (1.0 + thresholds.maxSlowdown);
+
+            std::cout << std::setw(10) << std::setprecision(0) << maxAbsError << std::setw(10) << std::setprecision(2) << psnr << std::setw(10) << std::setprecision(4) << ssim
+                      << std::setw(12) << std::setprecision(2) << ms;
+            if (hasBaseline)
+                std::cout << std::setw(14) << baseline[names[i]];
+            else
+                std::cout << std::setw(14) << "-";
+
+            std::cout << "  " << (!qualityPassed ? "QUALITY REGRESSION" : !speedPassed ? "PERFORMANCE REGRESSION"
+                                  : mode == RegressionMode::RecordTimings ? "ok, time recorded"
+                                  : !speedChecked ? "ok, NO TIMING BASELINE (recorded)" : "ok") << "\n";
+
+            // Kept next to the golden image for inspection
+            if (!qualityPassed)
+                cv::imwrite((directory / (names[i] + "_actual.png")).string(), result);
+
+            passed = passed && qualityPassed && speedPassed;
+        }
+
+        if (timings.size() != baseline.size() || mode != RegressionMode::Check)
+        {
+            std::ofstream timingsOut(timingsPath);
+            for (const auto& timing : timings)
+                timingsOut << timing.first << " " << timing.second << "\n";
+            std::cout << "\nTimings recorded to " << timingsPath.string() << "\n";
+        }
+
+        if (!updateGolden)
+        {
+            passed = runAllocationTest(originalImage, 10) && passed;
+            passed = runLabLayoutTest(originalImage) && passed;
+        }
+
+        std::cout << "\n" << (updateGolden ? "Golden images recorded to " + goldenDirectory : passed ? std::string("REGRESSION TEST PASSED") : std::string("REGRESSION TEST FAILED")) << "\n";
+        return passed ? 0 : 1;
+    }
+
+    /// <summary>
+    /// Mat allocator that counts the buffers it creates and leaves them to
+    /// the standard allocator. Installed as the default allocator it also
+    /// sees the planes created inside the OpenCV library, which a replaced
+    /// operator new of the executable does not when OpenCV is a DLL.
+    /// </summary>
+    class CountingMatAllocator : public cv::MatAllocator
+    {
+        mutable std::atomic<size_t> allocations{ 0 };
+
+    public:
+
+        cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override
+        {
+            // Buffers created here belong to the standard allocator, which also frees them
+            cv::UMatData* buffer = cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+            if (!data)
+                allocations++;
+            return buffer;
+        }
+
+        bool allocate(cv::UMatData* data, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override
+        {
+            return cv::Mat::getStdAllocator()->allocate(data, accessFlags, usageFlags);
+        }
+
+        void deallocate(cv::UMatData* data) const override
+        {
+            cv::Mat::getStdAllocator()->deallocate(data);
+        }
+
+        /// <summary>
+        /// Buffers allocated so far
+        /// </summary>
+        /// <returns>Count</returns>
+        size_t count() const
+        {
+            return allocations;
+        }
+    };
+
+    /// <summary>
+    /// Checks that a filter with a workspace allocates no plane once it is
+    /// warm (see the overload taking a heap counter)
+    /// </summary>
+    /// <param name="image">Image to filter</param>
+    /// <param name="calls">Calls checked after the warm-up</param>
+    /// <returns>True if none of the checked calls allocated a plane</returns>
+    static bool runAllocationTest(const cv::Mat& image, int calls)
+    {
+        return runAllocationTest(image, calls, nullptr);
+    }
+
+    /// <summary>
+    /// Checks that a filter with a workspace makes no allocation once it is
+    /// warm: every test case in every blur mode is applied twice to warm up,
+    /// then the given number of times into the same output image. Planes are
+    /// counted by a CountingMatAllocator installed as the default allocator
+    /// for the test. Other heap allocations can only be counted by a program
+    /// that replaces operator new (see AllocationTest/AllocationTest.cpp),
+    /// which passes its counter in.
+    /// </summary>
+    /// <param name="image">Image to filter</param>
+    /// <param name="calls">Calls checked after the warm-up</param>
+    /// <param name="heapAllocations">Returns the operator new calls so far, or nullptr to count planes only</param>
+    /// <returns>True if none of the checked calls allocated</returns>
+    static bool runAllocationTest(const cv::Mat& image, int calls, const std::function<size_t()>& heapAllocations)
+    {
+        std::cout << "\n--- Steady-state allocations (" << calls << " calls after 2 warm-up calls) ---\n";
+        std::cout << std::left << std::setw(16) << "case" << std::setw(14) << "blur" << std::right << std::setw(8) << "planes" << std::setw(8) << "heap" << "\n";
+
+        const ShadowHighlightsFilter::BlurMode modes[] = { ShadowHighlightsFilter::BlurMode::Exact, ShadowHighlightsFilter::BlurMode::Recursive, ShadowHighlightsFilter::BlurMode::BoxCascade };
+        const char* modeNames[] = { "exact", "recursive", "box cascade" };
+        std::vector<ShadowHighlightsFilter::Params> cases = testCases();
+        std::vector<std::string> names = testCaseNames();
+        bool passed = true;
+
+        CountingMatAllocator counter;
+        cv::MatAllocator* previousAllocator = cv::Mat::getDefaultAllocator();
+
+        for (size_t i = 0; i < cases.size(); i++)
+            for (int mode = 0; mode < 3; mode++)
+            {
+                ShadowHighlightsFilter filter(cases[i].shadowAmount, cases[i].highlightAmount, cases[i].tonalWidth, cases[i].blurRadius);
+                filter.setBlurMode(modes[mode]);
+                filter.setCacheEnabled(false);
+                filter.setWorkspace(std::make_shared<Workspace>());
+
+                cv::Mat result;
+                filter.apply(image, result);
+                filter.apply(image, result);
+
+                cv::Mat::setDefaultAllocator(&counter);
+                const size_t planesBefore = counter.count();
+                const size_t heapBefore = heapAllocations ? heapAllocations() : 0;
+
+                for (int call = 0; call < calls; call++)
+                    filter.apply(image, result);
+
+                const size_t heap = heapAllocations ? heapAllocations() - heapBefore : 0;
+                const size_t planes = counter.count() - planesBefore;
+                cv::Mat::setDefaultAllocator(previousAllocator);
+
+                std::cout << std::left << std::setw(16) << names[i] << std::setw(14) << modeNames[mode] << std::right << std::setw(8) << planes;
+                if (heapAllocations)
+                    std::cout << std::setw(8) << heap;
+                else
+                    std::cout << std::setw(8) << "-";
+                std::cout << (planes == 0 && heap == 0 ? "  ok\n" : "  ALLOCATES\n");
+
+                passed = passed && planes == 0 && heap == 0;
+            }
+
+        return passed;
+    }
+
+    /// <summary>
+    /// Checks the channel views and the planar Lab container against
+    /// splitLab and mergeLab on the Lab conversion of an image: every view
+    /// must read and write the same values as the split channel, and a
+    /// planar round trip must give back the Lab image exactly.
+    /// </summary>
+    /// <param name="image">BGR image</param>
+    /// <returns>True if every comparison is exact</returns>
+    static bool runLabLayoutTest(const cv::Mat& image)
+    {
+        std::cout << "\n--- Lab channel views and planes ---\n";
+
+        cv::Mat lab = ColorConverter::BGR2Lab(image);
+        const cv::Mat& constLab = lab;
+        std::vector<cv::Mat> channels = LabImageProcessor::splitLab(lab);
+
+        // Views read the interleaved image in place
+        bool viewsMatch = true;
+        for (int ch = 0; ch < 3; ch++)
+        {
+            LabImageProcessor::ChannelView<float> view = LabImageProcessor::channelView(lab, ch);
+            LabImageProcessor::ChannelView<const float> constView = LabImageProcessor::channelView(constLab, ch);
+            viewsMatch = viewsMatch && view.rows() == lab.rows && view.cols() == lab.cols;
+
+            for (int y = 0; y < lab.rows; y++)
+                for (int x = 0; x < lab.cols; x++)
+                    viewsMatch = viewsMatch && view(y, x) == channels[ch].at<float>(y, x) && constView(y, x) == channels[ch].at<float>(y, x);
+        }
+
+        // Writes through a view land in the interleaved pixels: L is copied over a
+        cv::Mat written = lab.clone();
+        LabImageProcessor::ChannelView<float> lView = LabImageProcessor::channelView(written, 0), aView = LabImageProcessor::channelView(written, 1);
+        for (int y = 0; y < written.rows; y++)
+            for (int x = 0; x < written.cols; x++)
+                aView(y, x) = lView(y, x);
+        std::vector<cv::Mat> writtenChannels = LabImageProcessor::splitLab(written);
+        bool writesMatch = cv::norm(writtenChannels[0], channels[0], cv::NORM_INF) == 0.0 && cv::norm(writtenChannels[1], channels[0], cv::NORM_INF) == 0.0
+                           && cv::norm(writtenChannels[2], channels[2], cv::NORM_INF) == 0.0;
+
+        LabImageProcessor::PlanarLab planar = LabImageProcessor::toPlanar(lab);
+        bool planesMatch = planar.size() == lab.size();
+        for (int ch = 0; ch < 3; ch++)
+            planesMatch = planesMatch && cv::norm(planar.channels[ch], channels[ch], cv::NORM_INF) == 0.0;
+
+        bool roundTripMatches = cv::norm(LabImageProcessor::fromPlanar(planar), LabImageProcessor::mergeLab(channels), cv::NORM_INF) == 0.0
+                                && cv::norm(LabImageProcessor::fromPlanar(planar), lab, cv::NORM_INF) == 0.0;
+
+        bool rejectsBgr = false;
+        try
+        {
+            LabImageProcessor::toPlanar(image);
+        }
+        catch (const std::invalid_argument&)
+        {
+            rejectsBgr = true;
+        }
+
+        std::cout << std::left << std::setw(36) << "channelView vs splitLab" << (viewsMatch ? "ok\n" : "MISMATCH\n")
+                  << std::setw(36) << "write through channelView" << (writesMatch ? "ok\n" : "MISMATCH\n")
+                  << std::setw(36) << "toPlanar vs splitLab" << (planesMatch ? "ok\n" : "MISMATCH\n")
+                  << std::setw(36) << "fromPlanar vs mergeLab" << (roundTripMatches ? "ok\n" : "MISMATCH\n")
+                  << std::setw(36) << "toPlanar rejects CV_8UC3" << (rejectsBgr ? "ok\n" : "ACCEPTED\n") << std::right;
+
+        return viewsMatch && writesMatch && planesMatch && roundTripMatches && rejectsBgr;
+    }
+
+    /// <summary>
+    /// Compares an image with a reference
+    /// </summary>
+    /// <param name="image">Image to check (CV_8UC3)</param>
+    /// <param name="reference">Reference of the same size and type</param>
+    /// <param name="maxAbsError">Largest channel difference in levels</param>
+    /// <param name="psnr">Peak signal-to-noise ratio in dB, infinite for equal images</param>
+    /// <param name="ssim">Mean SSIM over pixels and channels (11-tap Gaussian window, sigma 1.5)</param>
+    static void compareImages(const cv::Mat& image, const cv::Mat& reference, double& maxAbsError, double& psnr, double& ssim)
+    {
+        const int channels = image.channels();
+        double squaredSum = 0.0;
+        maxAbsError = 0.0;
+
+        for (int y = 0; y < image.rows; y++)
+        {
+            const uchar* a = image.ptr<uchar>(y);
+            const uchar* b = reference.ptr<uchar>(y);
+
+            for (int i = 0; i < image.cols * channels; i++)
+            {
+                double difference = std::abs((int)a[i] - (int)b[i]);
+                maxAbsError = std::max(maxAbsError, difference);
+                squaredSum += difference * difference;
+            }
+        }
+
+        double mse = squaredSum / ((double)image.total() * channels);
+        psnr = (mse > 0.0) ? 10.0 * std::log10(255.0 * 255.0 / mse) : std::numeric_limits<double>::infinity();
+
+        // SSIM per channel from local means, variances and covariance
+        const double c1 = (0.01 * 255) * (0.01 * 255), c2 = (0.03 * 255) * (0.03 * 255);
+        const std::vector<float> window = GaussianBlur::createKernel(11, 1.5f);
+        double ssimSum = 0.0;
+
+        for (int c = 0; c < channels; c++)
+        {
+            cv::Mat x(image.size(), CV_32F), z(image.size(), CV_32F), xx(image.size(), CV_32F), zz(image.size(), CV_32F), xz(image.size(), CV_32F);
+
+            for (int y = 0; y < image.rows; y++)
+            {
+                const uchar* a = image.ptr<uchar>(y);
+                const uchar* b = reference.ptr<uchar>(y);
+
+                for (int i = 0; i < image.cols; i++)
+                {
+                    float va = a[i * channels + c], vb = b[i * channels + c];
+                    x.at<float>(y, i) = va;
+                    z.at<float>(y, i) = vb;
+                    xx.at<float>(y, i) = va * va;
+                    zz.at<float>(y, i) = vb * vb;
+                    xz.at<float>(y, i) = va * vb;
+                }
+            }
+
+            cv::Mat meanX = GaussianBlur::apply(x, window), meanZ = GaussianBlur::apply(z, window);
+            cv::Mat meanXX = GaussianBlur::apply(xx, window), meanZZ = GaussianBlur::apply(zz, window), meanXZ = GaussianBlur::apply(xz, window);
+
+            double channelSum = 0.0;
+            for (int y = 0; y < image.rows; y++)
+                for (int i = 0; i < image.cols; i++)
+                {
+                    double mx = meanX.at<float>(y, i), mz = meanZ.at<float>(y, i);
+                    double varianceX = meanXX.at<float>(y, i) - mx * mx, varianceZ = meanZZ.at<float>(y, i) - mz * mz;
+                    double covariance = meanXZ.at<float>(y, i) - mx * mz;
+
+                    channelSum += ((2 * mx * mz + c1) * (2 * covariance + c2)) / ((mx * mx + mz * mz + c1) * (varianceX + varianceZ + c2));
+                }
+
+            ssimSum += channelSum / image.total();
+        }
+
+        ssim = ssimSum / channels;
+    }
+
     /// <summary>
     /// Runs optimized test with best parameters
     /// </summary>
@@ -98,7 +526,11 @@ public:
         std::cout << "FINAL TEST WITH OPTIMIZATION\n";
 
         ShadowHighlightsFilter optimalFilter(0.2f, 0.2f, 0.4f, 10.0f);
-        cv::Mat optimalResult = optimalFilter.apply(image);
+        StageStats stats;
+        cv::Mat optimalResult = optimalFilter.apply(image, stats);
+
+        std::cout << "\n--- STAGE TIMINGS ---\n";
+        stats.print();
 
         std::cout << "\n--- RESULTS COMPARISON ---\n";
         analyzePixels(image, optimalResult);
@@ -134,6 +566,42 @@ public:
     }
 
 private:
+    /// <summary>
+    /// Parameter cases of the comprehensive and regression tests
+    /// </summary>
+    /// <returns>Shadows 50%, highlights 40%, both 30%/20%, both 70%/50%</returns>
+    static std::vector<ShadowHighlightsFilter::Params> testCases()
+    {
+        std::vector<ShadowHighlightsFilter::Params> cases(4);
+
+        // Case 1: Only shadow lightening
+        cases[0].shadowAmount = 0.5f;
+        cases[0].highlightAmount = 0.0f;
+
+        // Case 2: Only highlight darkening
+        cases[1].shadowAmount = 0.0f;
+        cases[1].highlightAmount = 0.4f;
+
+        // Case 3: Combined correction
+        cases[2].shadowAmount = 0.3f;
+        cases[2].highlightAmount = 0.2f;
+
+        // Case 4: Strong correction
+        cases[3].shadowAmount = 0.7f;
+        cases[3].highlightAmount = 0.5f;
+
+        return cases;
+    }
+
+    /// <summary>
+    /// Names of the cases from testCases, used for the golden image files
+    /// </summary>
+    /// <returns>Names in the order of the cases</returns>
+    static std::vector<std::string> testCaseNames()
+    {
+        return { "shadows_50", "highlights_40", "both_30_20", "strong_70_50" };
+    }
+
     /// <summary>
     /// Analyzes specific image pixels
     /// </summary>
@@ -167,30 +635,28 @@ private:
     /// <param name="result1">First result image</param>
     /// <param name="result2">Second result image</param>
     /// <param name="result3">Third result image</param>
-    /// <param name="result4">Fourth result image</param>
     /// <returns>Comparison mosaic image</returns
-    static cv::Mat createComparisonMosaic(const cv::Mat& original, const cv::Mat& result1, const cv::Mat& result2, const cv::Mat& result3, const cv::Mat& result4)
+    static cv::Mat createComparisonMosaic(const cv::Mat& original, const cv::Mat& result1, const cv::Mat& result2, const cv::Mat& result3)
     {
         int displayWidth = 600;
         int displayHeight = 400;
 
-        cv::Mat displayOriginal, displayResult1, displayResult2, displayResult3, displayResult4;
-        cv::resize(original, displayOriginal, cv::Size(displayWidth, displayHeight));
-        cv::resize(result1, displayResult1, cv::Size(displayWidth, displayHeight));
-        cv::resize(result2, displayResult2, cv::Size(displayWidth, displayHeight));
-        cv::resize(result3, displayResult3, cv::Size(displayWidth, displayHeight));
-        cv::resize(result4, displayResult4, cv::Size(displayWidth, displayHeight));
+        // Each image is resized straight into its quadrant, so the mosaic is not assembled by copies
+        cv::Mat finalDisplay(2 * displayHeight, 2 * displayWidth, CV_8UC3);
+        cv::Mat displayOriginal = finalDisplay(cv::Rect(0, 0, displayWidth, displayHeight));
+        cv::Mat displayResult1 = finalDisplay(cv::Rect(displayWidth, 0, displayWidth, displayHeight));
+        cv::Mat displayResult2 = finalDisplay(cv::Rect(0, displayHeight, displayWidth, displayHeight));
+        cv::Mat displayResult3 = finalDisplay(cv::Rect(displayWidth, displayHeight, displayWidth, displayHeight));
+
+        cv::resize(original, displayOriginal, displayOriginal.size());
+        cv::resize(result1, displayResult1, displayResult1.size());
+        cv::resize(result2, displayResult2, displayResult2.size());
+        cv::resize(result3, displayResult3, displayResult3.size());
 
         cv::putText(displayOriginal, "Original", cv::Point(10, 30), cv::FONT_HERSHEY_SIMPLEX, 1, cv::Scalar(255, 255, 255), 2);
         cv::putText(displayResult1, "Shadows 50%", cv::Point(10, 30), cv::FONT_HERSHEY_SIMPLEX, 1, cv::Scalar(255, 255, 255), 2);
         cv::putText(displayResult2, "Highlights 40%", cv::Point(10, 30), cv::FONT_HERSHEY_SIMPLEX, 1, cv::Scalar(255, 255, 255), 2);
         cv::putText(displayResult3, "Both 30%/20%", cv::Point(10, 30), cv::FONT_HERSHEY_SIMPLEX, 1, cv::Scalar(255, 255, 255), 2);
-        cv::putText(displayResult4, "Both 70%/50%", cv::Point(10, 30), cv::FONT_HERSHEY_SIMPLEX, 1, cv::Scalar(255, 255, 255), 2);
-
-        cv::Mat topRow, bottomRow, finalDisplay;
-        cv::hconcat(displayOriginal, displayResult1, topRow);
-        cv::hconcat(displayResult2, displayResult3, bottomRow);
-        cv::vconcat(topRow, bottomRow, finalDisplay);
 
         return finalDisplay;
     }
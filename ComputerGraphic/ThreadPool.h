@@ -0,0 +1,174 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+
+/// <summary>
+/// Fixed-size pool of worker threads for row-parallel loops.
+///
+/// parallelFor splits a row range into bands that depend only on the range
+/// and the thread count, and the calling thread works on bands too.
+/// Bands write disjoint rows, so results do not depend on scheduling.
+/// </summary>
+class ThreadPool
+{
+    /// <summary>Worker threads (the caller is the extra one)</summary>
+    std::vector<std::thread> workers;
+
+    /// <summary>Serializes parallelFor calls coming from different threads</summary>
+    std::mutex callMutex;
+
+    std::mutex stateMutex;
+    std::condition_variable jobReady, jobDone;
+
+    /// <summary>Current job: body and band layout</summary>
+    const std::function<void(int, int)>* body = nullptr;
+    int rangeBegin = 0, rangeEnd = 0, bandCount = 0;
+    std::atomic<int> nextBand{ 0 };
+
+    /// <summary>Job counter, workers run each generation once</summary>
+    uint64_t generation = 0;
+    int busyWorkers = 0;
+    bool stopping = false;
+
+public:
+
+    /// <summary>
+    /// Creates a pool
+    /// </summary>
+    /// <param name="threads">Total threads including the caller, 0 for all hardware threads</param>
+    explicit ThreadPool(int threads)
+    {
+        if (threads <= 0)
+            threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+        for (int i = 1; i < threads; i++)
+            workers.emplace_back([this]() { workerLoop(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            stopping = true;
+        }
+        jobReady.notify_all();
+
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /// <summary>
+    /// Number of threads working on a job, including the caller
+    /// </summary>
+    int size() const
+    {
+        return (int)workers.size() + 1;
+    }
+
+    /// <summary>
+    /// Runs body over [begin, end) split into bands and waits for completion
+    /// </summary>
+    /// <param name="begin">First row</param>
+    /// <param name="end">Row after the last</param>
+    /// <param name="function">Band body taking [bandBegin, bandEnd)</param>
+    void parallelFor(int begin, int end, const std::function<void(int, int)>& function)
+    {
+        if (end <= begin)
+            return;
+
+        if (workers.empty() || end - begin == 1)
+        {
+            function(begin, end);
+            return;
+        }
+
+        std::lock_guard<std::mutex> call(callMutex);
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            body = &function;
+            rangeBegin = begin;
+            rangeEnd = end;
+            bandCount = std::min(end - begin, size() * 4);
+            nextBand = 0;
+            busyWorkers = (int)workers.size();
+            generation++;
+        }
+        jobReady.notify_all();
+
+        runBands();
+
+        std::unique_lock<std::mutex> lock(stateMutex);
+        jobDone.wait(lock, [this]() { return busyWorkers == 0; });
+        body = nullptr;
+    }
+
+    /// <summary>
+    /// Runs body over [begin, end) on the pool, or directly if there is no pool
+    /// </summary>
+    /// <param name="pool">Pool or nullptr</param>
+    /// <param name="begin">First row</param>
+    /// <param name="end">Row after the last</param>
+    /// <param name="function">Band body taking [bandBegin, bandEnd)</param>
+    template <typename Function>
+    static void run(ThreadPool* pool, int begin, int end, const Function& function)
+    {
+        // The wrapper captures one reference, so std::function stores it without allocating
+        if (pool)
+            pool->parallelFor(begin, end, [&function](int bandBegin, int bandEnd) { function(bandBegin, bandEnd); });
+        else if (end > begin)
+            function(begin, end);
+    }
+
+private:
+
+    /// <summary>
+    /// Takes bands of the current job until none are left
+    /// </summary>
+    void runBands()
+    {
+        const int length = rangeEnd - rangeBegin;
+
+        for (int band = nextBand++; band < bandCount; band = nextBand++)
+        {
+            int bandBegin = rangeBegin + (int)((int64_t)length * band / bandCount);
+            int bandEnd = rangeBegin + (int)((int64_t)length * (band + 1) / bandCount);
+            (*body)(bandBegin, bandEnd);
+        }
+    }
+
+    void workerLoop()
+    {
+        uint64_t seen = 0;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(stateMutex);
+                jobReady.wait(lock, [&]() { return stopping || generation != seen; });
+
+                if (stopping)
+                    return;
+
+                seen = generation;
+            }
+
+            runBands();
+
+            {
+                std::lock_guard<std::mutex> lock(stateMutex);
+                busyWorkers--;
+            }
+            jobDone.notify_one();
+        }
+    }
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <opencv.hpp>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+/// <summary>
+/// Planes and kernels kept between filter calls, so that repeated calls on
+/// images of the same size allocate nothing once the workspace is warm.
+///
+/// A plane is handed out only while the workspace holds its sole reference,
+/// so a plane still used by the caller, a cache or another thread is never
+/// reused. Planes and kernels left unused by two consecutive calls are
+/// released.
+/// </summary>
+class Workspace
+{
+    struct Entry
+    {
+        cv::Mat plane;
+        uint64_t lastUsed;
+    };
+
+    struct KernelEntry
+    {
+        std::shared_ptr<const std::vector<float>> kernel;
+        uint64_t lastUsed;
+    };
+
+    std::mutex poolMutex;
+    std::vector<Entry> entries;
+    std::map<std::pair<float, int>, KernelEntry> kernels;
+    uint64_t generation = 0;
+
+public:
+
+    Workspace() = default;
+    Workspace(const Workspace&) = delete;
+    Workspace& operator=(const Workspace&) = delete;
+
+    /// <summary>
+    /// Takes a free plane of the given shape or allocates one
+    /// </summary>
+    /// <param name="rows">Rows</param>
+    /// <param name="cols">Columns</param>
+    /// <param name="type">OpenCV type</param>
+    /// <returns>Plane with undefined content, not referenced elsewhere</returns>
+    cv::Mat acquire(int rows, int cols, int type)
+    {
+        bool allocated;
+        return acquire(rows, cols, type, allocated);
+    }
+
+    /// <summary>
+    /// Takes a free plane of the given shape or allocates one
+    /// </summary>
+    /// <param name="rows">Rows</param>
+    /// <param name="cols">Columns</param>
+    /// <param name="type">OpenCV type</param>
+    /// <param name="allocated">Set to true if no free plane fitted and a new one was allocated</param>
+    /// <returns>Plane with undefined content, not referenced elsewhere</returns>
+    cv::Mat acquire(int rows, int cols, int type, bool& allocated)
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+
+        allocated = false;
+        for (Entry& entry : entries)
+            if (entry.plane.rows == rows && entry.plane.cols == cols && entry.plane.type() == type && entry.plane.u->refcount == 1)
+            {
+                entry.lastUsed = generation;
+                return entry.plane;
+            }
+
+        allocated = true;
+        entries.push_back({ cv::Mat(rows, cols, type), generation });
+        return entries.back().plane;
+    }
+
+    /// <summary>
+    /// Returns a kernel built once per radius and grid scale
+    /// </summary>
+    /// <param name="radius">Blur radius</param>
+    /// <param name="scale">Grid reduction</param>
+    /// <param name="create">Builds the kernel on the first request</param>
+    /// <returns>Kernel, kept alive by the returned pointer after it is released from the workspace</returns>
+    template <typename Factory>
+    std::shared_ptr<const std::vector<float>> kernel(float radius, int scale, Factory create)
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+
+        auto found = kernels.find(std::make_pair(radius, scale));
+        if (found == kernels.end())
+            found = kernels.emplace(std::make_pair(radius, scale), KernelEntry{ std::make_shared<const std::vector<float>>(create()), generation }).first;
+
+        found->second.lastUsed = generation;
+        return found->second.kernel;
+    }
+
+    /// <summary>
+    /// Marks the end of a filter call and releases the free planes and the
+    /// kernels that neither this call nor the previous one used
+    /// </summary>
+    void endCall()
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [this](const Entry& entry)
+            {
+                return entry.lastUsed + 1 < generation && entry.plane.u->refcount == 1;
+            }), entries.end());
+
+        // Preview radii change with the proxy size, so unused kernels must not pile up
+        for (auto kernel = kernels.begin(); kernel != kernels.end();)
+            if (kernel->second.lastUsed + 1 < generation)
+                kernel = kernels.erase(kernel);
+            else
+                ++kernel;
+
+        generation++;
+    }
+
+    /// <summary>
+    /// Releases every free plane and the kernels
+    /// </summary>
+    void release()
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [](const Entry& entry) { return entry.plane.u->refcount == 1; }), entries.end());
+        kernels.clear();
+    }
+
+    /// <summary>
+    /// Memory held by the planes, including the ones in use
+    /// </summary>
+    /// <returns>Bytes</returns>
+    size_t bytes()
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+
+        size_t total = 0;
+        for (const Entry& entry : entries)
+            total += entry.plane.total() * entry.plane.elemSize();
+        return total;
+    }
+};